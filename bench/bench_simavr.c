@@ -0,0 +1,375 @@
+/*
+ * bench_simavr.c - cycle counting benchmark for the LCD/serial firmware
+ * Description:	Runs a firmware image built with -DBENCHMARK on the simavr
+ *		ATMega 2560 model and reports:
+ *
+ *		- cycles per operation, from the BENCH_MARK writes to GPIOR0
+ *		  (ids are the BENCH_OP_* defines in main.c)
+ *		- echo throughput, as serial bytes per second out of USART0
+ *		  while a scripted session is typed in
+ *		- latency from the CR that ends a line to the first and last
+ *		  LCD write it causes
+ *		- LCD bus totals, decoded from E falling edges on PORTB1 with
+ *		  RS on PORTB0 and D4-D7 on PORTA4-7 (D0-D7 on PORTA once a
+ *		  function set selects the 8-bit interface), and the chars
+ *		  per second the LCD queue reaches while it drains a full
+ *		  screen
+ *
+ *		Results are written as JSON so runs can be diffed between
+ *		commits.
+ *
+ *		usage: bench_simavr <firmware.elf> <results.json>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_io.h"
+#include "sim_irq.h"
+#include "sim_cycle_timers.h"
+#include "avr_uart.h"
+#include "avr_ioport.h"
+
+#define BENCH_F_CPU 16000000UL
+#ifndef BENCH_BAUD
+#define BENCH_BAUD 57600UL					//make passes BAUD
+#endif
+#define BENCH_BYTE_CYCLES (BENCH_F_CPU * 10 / BENCH_BAUD)	//one 10 bit frame
+#define BENCH_MAX_CYCLES (BENCH_F_CPU * 120ULL)			//give up after 120 s
+#define BENCH_GPIOR0 0x3E					//data space address
+#define BENCH_PROMPT "command: "
+#define BENCH_ROUNDS 4						//times the script runs
+
+//  Names for the BENCH_OP_* ids in main.c  //
+static const char* opNames[] = {
+	"none",
+	"LCD_write_str",
+	"LCD_write_str_wrap",
+	"LCD_clear_line",
+	"checkInputLen",
+	"LCD_flush",
+	"lcd_drain",
+	"outputLine",
+	"loop_LCD_flush",
+	"lcd_byte",
+};
+#define BENCH_OPS (sizeof(opNames) / sizeof(opNames[0]))
+#define BENCH_OP_FLUSH 5					//LCD_flush
+#define BENCH_OP_LCD_DRAIN 6					//lcd_drain
+
+//  Scripted serial session - one entry per line typed at the prompt  //
+static const char* script[] = {
+	"this is fun",
+	"sixteen chars ok",
+	"split over both lines of LCD",
+	"this line is much too long for the screen",
+	"",
+	"\x03",
+	"short",
+	"sixteen chars ok",
+};
+#define BENCH_LINES (sizeof(script) / sizeof(script[0]))
+
+static struct {
+	avr_cycle_count_t start;
+	uint8_t current;
+	unsigned long count[BENCH_OPS];
+	avr_cycle_count_t total[BENCH_OPS];
+	avr_cycle_count_t min[BENCH_OPS];
+	avr_cycle_count_t max[BENCH_OPS];
+} ops;
+
+static struct {
+	avr_irq_t* input;		//bytes into USART0
+	char tail[sizeof(BENCH_PROMPT)];//last bytes out, to spot the prompt
+	unsigned line;			//next script line
+	const char* send;		//rest of the line being typed
+	uint8_t sendingCr;
+	avr_cycle_count_t firstIn;
+	avr_cycle_count_t lastOut;
+	unsigned long bytesIn;
+	unsigned long bytesOut;
+	uint8_t done;
+} uart;
+
+static struct {
+	uint8_t porta;
+	uint8_t rs;
+	uint8_t e;
+	uint8_t eightBit;		//interface data length, 8-bit after power up
+	uint8_t high;
+	uint8_t lowNext;
+	unsigned long pulses;		//E falling edges
+	unsigned long instructions;
+	unsigned long chars;
+	unsigned long drainChars;	//chars sent during LCD_flush and lcd_drain
+	avr_cycle_count_t lastWrite;
+} lcd = { .eightBit = 1 };
+
+static struct {
+	avr_cycle_count_t crCycle;	//CR of the line being measured
+	avr_cycle_count_t first;
+	avr_cycle_count_t last;
+	uint8_t open;
+	unsigned long lines;
+	avr_cycle_count_t firstTotal;
+	avr_cycle_count_t lastTotal;
+	avr_cycle_count_t lastMax;
+} latency;
+
+//  GPIOR0 write - start or end of a benchmarked operation  //
+static void gpior0_write(struct avr_t* avr, avr_io_addr_t addr, uint8_t v, void* param){
+	(void)param;
+	avr->data[addr] = v;
+	if(v != 0){
+		ops.current = v < BENCH_OPS ? v : 0;
+		ops.start = avr->cycle;
+		return;
+	}
+	if(ops.current != 0){
+		avr_cycle_count_t n = avr->cycle - ops.start;
+		uint8_t op = ops.current;
+
+		if(ops.count[op] == 0 || n < ops.min[op]) ops.min[op] = n;
+		if(n > ops.max[op]) ops.max[op] = n;
+		ops.total[op] += n;
+		ops.count[op]++;
+		ops.current = 0;
+	}
+}
+
+//  A complete byte reached the LCD  //
+static void lcd_byte(avr_t* avr, uint8_t b){
+	if(lcd.rs){
+		lcd.chars++;
+		if(ops.current == BENCH_OP_FLUSH || ops.current == BENCH_OP_LCD_DRAIN){
+			lcd.drainChars++;
+		}
+	}
+	else{
+		lcd.instructions++;
+		if((b & 0xE0) == 0x20){		//function set, DL picks the bus width
+			lcd.eightBit = (b & 0x10) != 0;
+		}
+	}
+	lcd.lastWrite = avr->cycle;
+	if(latency.open){
+		if(latency.first == 0) latency.first = avr->cycle;
+		latency.last = avr->cycle;
+	}
+}
+
+static void porta_change(struct avr_irq_t* irq, uint32_t value, void* param){
+	(void)irq; (void)param;
+	lcd.porta = value;
+}
+
+static void rs_change(struct avr_irq_t* irq, uint32_t value, void* param){
+	(void)irq; (void)param;
+	lcd.rs = value != 0;
+}
+
+//  E pin - the LCD latches the data lines on the falling edge  //
+static void e_change(struct avr_irq_t* irq, uint32_t value, void* param){
+	avr_t* avr = param;
+	(void)irq;
+
+	if(lcd.e && !value){
+		uint8_t nibble = lcd.porta & 0xF0;
+
+		lcd.pulses++;
+		if(lcd.eightBit){		//whole byte, D0-D3 read low on a 4-bit bus
+			lcd_byte(avr, lcd.porta);
+		}
+		else if(!lcd.lowNext){
+			lcd.high = nibble;
+			lcd.lowNext = 1;
+		}
+		else{
+			lcd.lowNext = 0;
+			lcd_byte(avr, lcd.high | (nibble >> 4));
+		}
+	}
+	lcd.e = value != 0;
+}
+
+//  Types the next byte of the current script line, one frame at a time  //
+static avr_cycle_count_t uart_type(struct avr_t* avr, avr_cycle_count_t when, void* param){
+	uint8_t c;
+	(void)param;
+
+	if(uart.send == NULL){
+		return 0;
+	}
+	if(*uart.send != '\0'){
+		c = *uart.send++;
+	}
+	else{
+		c = '\r';
+		uart.send = NULL;
+		latency.crCycle = avr->cycle;
+		latency.first = 0;
+		latency.last = 0;
+		latency.open = 1;
+	}
+	if(uart.firstIn == 0){
+		uart.firstIn = avr->cycle;
+	}
+	uart.bytesIn++;
+	avr_raise_irq(uart.input, c);
+	return uart.send ? when + BENCH_BYTE_CYCLES : 0;
+}
+
+//  Byte out of USART0 - starts the next line once the prompt is seen  //
+static void uart_output(struct avr_irq_t* irq, uint32_t value, void* param){
+	avr_t* avr = param;
+	size_t n = strlen(BENCH_PROMPT);
+	(void)irq;
+
+	uart.bytesOut++;
+	uart.lastOut = avr->cycle;
+	memmove(uart.tail, uart.tail + 1, n - 1);
+	uart.tail[n - 1] = (char)value;
+	if(memcmp(uart.tail, BENCH_PROMPT, n) != 0){
+		return;
+	}
+
+	if(latency.open){		//previous line is complete
+		latency.open = 0;
+		if(latency.first != 0){
+			latency.lines++;
+			latency.firstTotal += latency.first - latency.crCycle;
+			latency.lastTotal += latency.last - latency.crCycle;
+			if(latency.last - latency.crCycle > latency.lastMax){
+				latency.lastMax = latency.last - latency.crCycle;
+			}
+		}
+	}
+	if(uart.line >= BENCH_LINES * BENCH_ROUNDS){
+		uart.done = 1;
+		return;
+	}
+	uart.send = script[uart.line++ % BENCH_LINES];
+	avr_cycle_timer_register(avr, BENCH_BYTE_CYCLES, uart_type, NULL);
+}
+
+static double cycles_to_us(double cycles){
+	return cycles * 1e6 / BENCH_F_CPU;
+}
+
+//  Write the results file  //
+static void write_results(FILE* out, const char* elf, avr_t* avr){
+	double seconds = (double)(uart.lastOut - uart.firstIn) / BENCH_F_CPU;
+	avr_cycle_count_t drainCycles;
+	unsigned i;
+	int first = 1;
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"firmware\": \"%s\",\n", elf);
+	fprintf(out, "  \"f_cpu\": %lu,\n", BENCH_F_CPU);
+	fprintf(out, "  \"baud\": %lu,\n", BENCH_BAUD);
+	fprintf(out, "  \"total_cycles\": %llu,\n", (unsigned long long)avr->cycle);
+	fprintf(out, "  \"ops\": {");
+	for(i = 1; i < BENCH_OPS; i++){
+		if(ops.count[i] == 0) continue;
+		fprintf(out, "%s\n    \"%s\": {\"count\": %lu, \"cycles_min\": %llu, "
+			"\"cycles_avg\": %.1f, \"cycles_max\": %llu}",
+			first ? "" : ",", opNames[i], ops.count[i],
+			(unsigned long long)ops.min[i],
+			(double)ops.total[i] / ops.count[i],
+			(unsigned long long)ops.max[i]);
+		first = 0;
+	}
+	fprintf(out, "\n  },\n");
+	fprintf(out, "  \"echo\": {\"lines\": %u, \"bytes_in\": %lu, \"bytes_out\": %lu, "
+		"\"seconds\": %.6f, \"bytes_per_second\": %.1f},\n",
+		uart.line, uart.bytesIn, uart.bytesOut, seconds,
+		seconds > 0 ? uart.bytesOut / seconds : 0.0);
+	fprintf(out, "  \"latency\": {\"lines\": %lu, \"cr_to_first_lcd_us_avg\": %.1f, "
+		"\"cr_to_last_lcd_us_avg\": %.1f, \"cr_to_last_lcd_us_max\": %.1f},\n",
+		latency.lines,
+		latency.lines ? cycles_to_us((double)latency.firstTotal / latency.lines) : 0.0,
+		latency.lines ? cycles_to_us((double)latency.lastTotal / latency.lines) : 0.0,
+		cycles_to_us((double)latency.lastMax));
+	drainCycles = ops.total[BENCH_OP_FLUSH] + ops.total[BENCH_OP_LCD_DRAIN];
+	fprintf(out, "  \"lcd\": {\"bus_bits\": %u, \"instructions\": %lu, \"chars\": %lu, "
+		"\"e_pulses\": %lu, \"drain_chars\": %lu, \"drain_chars_per_second\": %.1f}\n",
+		lcd.eightBit ? 8 : 4, lcd.instructions, lcd.chars, lcd.pulses, lcd.drainChars,
+		drainCycles ? lcd.drainChars * (double)BENCH_F_CPU / drainCycles : 0.0);
+	fprintf(out, "}\n");
+}
+
+int main(int argc, char** argv){
+	elf_firmware_t firmware;
+	avr_t* avr;
+	uint32_t flags = 0;
+	int state = cpu_Running;
+	FILE* out;
+	static const char* irqNames[] = { "8<bench.uart_in" };
+
+	if(argc != 3){
+		fprintf(stderr, "usage: %s <firmware.elf> <results.json>\n", argv[0]);
+		return 2;
+	}
+	memset(&firmware, 0, sizeof(firmware));
+	if(elf_read_firmware(argv[1], &firmware) != 0){
+		fprintf(stderr, "%s: cannot read %s\n", argv[0], argv[1]);
+		return 1;
+	}
+	avr = avr_make_mcu_by_name("atmega2560");
+	if(avr == NULL){
+		fprintf(stderr, "%s: simavr has no atmega2560 model\n", argv[0]);
+		return 1;
+	}
+	avr_init(avr);
+	avr_load_firmware(avr, &firmware);
+	avr->frequency = BENCH_F_CPU;
+
+	//USART0 - keep output off stdout, connect the script input
+	avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+	flags &= ~AVR_UART_FLAG_STDIO;
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+	uart.input = avr_alloc_irq(&avr->irq_pool, 0, 1, irqNames);
+	avr_connect_irq(uart.input, avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT));
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT),
+		uart_output, avr);
+
+	//LCD bus and benchmark markers
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('A'), IOPORT_IRQ_PIN_ALL),
+		porta_change, avr);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 0),
+		rs_change, avr);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 1),
+		e_change, avr);
+	avr_register_io_write(avr, BENCH_GPIOR0, gpior0_write, NULL);
+
+	//run until the script is done and the LCD has been quiet for 10 ms
+	while(state != cpu_Done && state != cpu_Crashed && avr->cycle < BENCH_MAX_CYCLES){
+		state = avr_run(avr);
+		if(uart.done && avr->cycle - lcd.lastWrite > BENCH_F_CPU / 100
+		   && avr->cycle - uart.lastOut > BENCH_F_CPU / 100){
+			break;
+		}
+	}
+	if(state == cpu_Crashed || !uart.done){
+		fprintf(stderr, "%s: firmware %s after %llu cycles, %u of %lu lines sent\n",
+			argv[0], state == cpu_Crashed ? "crashed" : "stalled",
+			(unsigned long long)avr->cycle, uart.line,
+			(unsigned long)(BENCH_LINES * BENCH_ROUNDS));
+		return 1;
+	}
+
+	out = fopen(argv[2], "w");
+	if(out == NULL){
+		perror(argv[2]);
+		return 1;
+	}
+	write_results(out, argv[1], avr);
+	fclose(out);
+	write_results(stdout, argv[1], avr);
+	return 0;
+}
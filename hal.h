@@ -0,0 +1,71 @@
+/*
+ * hal.h - hardware abstraction layer for the LCD/serial firmware
+ * Description:	Thin layer between main.c and the hardware it drives. Covers
+ *		the LCD bus pins, the heartbeat pin, USART0-3, the backlight 
+ *		PWM, the system tick and LCD queue timers, idle sleep and the
+ *		delay routines. Two backends exist:
+ *
+ *		hal_avr.h	ATMega 2560 - every call is a static inline
+ *				register access, so the firmware costs the same
+ *				as writing the registers directly.
+ *		hal_host.c	Linux - emulates the KS0066U LCD controller
+ *				and serves the USARTs on ptys (or files), so the
+ *				firmware logic can run without a board.
+ *
+ *		Build with HAL_HOST defined to select the Linux backend.
+ *
+ *		Interrupt handlers keep using ISR(vector). On the host
+ *		backend ISR(vector) defines hal_isr_<vector>(), which the
+ *		emulator calls when the matching event is due.
+ *
+ *		With UART_FLOW set to UART_FLOW_RTSCTS, hal_uart_rts() and
+ *		hal_uart_cts() drive and read the USART0 handshake lines.
+ *
+ *		hal_reset_power_on() tells a power on reset, after which the
+ *		LCDs need their power up wait, from a reset button or
+ *		watchdog reset, where they kept running.
+ *
+ *		The LCD enable line is pulsed with hal_lcd_e_pulse(), which
+ *		holds E high for HAL_LCD_E_HIGH_NS and returns once a full
+ *		HAL_LCD_E_CYCLE_NS has passed. hal_lcd_e() is only needed
+ *		where E must stay high, as for a busy flag read.
+ *
+ *		Every busy-wait loop in main.c calls hal_wait() while it
+ *		spins. It does nothing on the AVR (the interrupts do the
+ *		work) and runs the due emulated interrupts on the host.
+ */
+
+#ifndef HAL_H_
+#define HAL_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+//  LCD enable timing both backends drive, in ns - the HD44780 limits, which
+//  also cover the KS0066U (230 ns high, 500 ns cycle)  //
+#define HAL_LCD_E_HIGH_NS 450UL		//E high
+#define HAL_LCD_E_CYCLE_NS 1000UL	//E rise to the next E rise
+
+//  Flow control on USART0, chosen with UART_FLOW. Both backends need it - 
+//  the host emulator stops sending the way a real host would  //
+#define UART_FLOW_NONE    0
+#define UART_FLOW_XONXOFF 1		//XOFF and XON bytes sent to the host
+#define UART_FLOW_RTSCTS  2		//RTS and CTS lines on GPIO pins
+#ifndef UART_FLOW
+#define UART_FLOW UART_FLOW_NONE
+#endif
+#define UART_XON  0x11
+#define UART_XOFF 0x13
+
+//  EEPROM - the ATMega 2560 has 4 KB. hal_eeprom_write() starts a byte that
+//  takes HAL_EEPROM_WRITE_US, and hal_eeprom_busy() is set until it is done  //
+#define HAL_EEPROM_SIZE 4096
+#define HAL_EEPROM_WRITE_US 3400UL
+
+#ifdef HAL_HOST
+#include "hal_host.h"
+#else
+#include "hal_avr.h"
+#endif
+
+#endif /* HAL_H_ */
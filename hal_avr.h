@@ -0,0 +1,482 @@
+/*
+ * hal_avr.h - ATMega 2560 backend for hal.h
+ * Description:	Register level implementation of the hardware abstraction
+ *		layer. Every function is a static inline so each call
+ *		compiles down to the same register accesses main.c used to
+ *		make directly. Pin assignments match the wiring diagram at
+ *		the top of main.c.
+ *
+ *		The LCD bus pins are set by the pin map below. Each nybble
+ *		is one OUT to the data port, and E is pulsed by writing its
+ *		bit to the PINx register twice, which toggles the pin without
+ *		a read-modify-write. The E high and low times are counted in
+ *		CPU cycles from F_CPU instead of whole microsecond delays.
+ */
+
+#ifndef HAL_AVR_H_
+#define HAL_AVR_H_
+
+#include <avr/io.h>
+#include <util/delay.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/pgmspace.h>	//PROGMEM, PSTR and the _P string/stdio calls
+
+#include "lcd_geometry.h"	//LCD_PANELS
+
+//  LCD pin map - D4-D7 on one nybble of the data port, or D0-D7 on all of it  //
+#define LCD_DATA_PORT PORTA
+#define LCD_DATA_DDR  DDRA
+#define LCD_DATA_PIN  PINA
+#if LCD_BUS_8BIT
+#define LCD_DATA_MASK 0xFF
+#define LCD_DATA_D7 7
+#else
+#define LCD_DATA_SHIFT 4		//D4 on bit 4, so the upper nybble is sent as is
+#define LCD_DATA_MASK (0x0F << LCD_DATA_SHIFT)
+#define LCD_DATA_D7 (LCD_DATA_SHIFT + 3)
+#endif
+
+//  1 if nothing else uses the data port. The nybble is then written with a
+//  single OUT, which also keeps the pull-ups on the other pins off. With 0 the
+//  lines that change are toggled through PINx and the other pins are left alone  //
+#ifndef LCD_DATA_PORT_OWNED
+#define LCD_DATA_PORT_OWNED 1
+#endif
+
+//  Pin definitions for PORTB control lines  //
+#define LCD_CTRL_PORT PORTB
+#define LCD_CTRL_DDR  DDRB
+#define LCD_CTRL_PIN  PINB
+#define LCD_EnablePin 1
+#define LCD_RegisterSelectPin 0
+#define LCD_ReadWritePin 2                         // only used with LCD_USE_BUSY_FLAG //
+#define HeartbeatPin 5
+
+//  E lines for panels 1-3 (LCD_PANELS > 1) on PORTC, from this pin up  //
+#define LCD_EXTRA_E_PORT PORTC
+#define LCD_EXTRA_E_DDR  DDRC
+#define LCD_EXTRA_E_PIN  PINC
+#define LCD_ExtraEnablePin 0
+
+//  E high and low times in CPU cycles, rounded up  //
+#define HAL_NS_TO_CYCLES(ns) (((ns) * (F_CPU / 1000000UL) + 999UL) / 1000UL)
+#define LCD_E_HIGH_CYCLES HAL_NS_TO_CYCLES(HAL_LCD_E_HIGH_NS)
+#define LCD_E_LOW_CYCLES  (HAL_NS_TO_CYCLES(HAL_LCD_E_CYCLE_NS) - LCD_E_HIGH_CYCLES)
+
+//  USART0 handshake lines for UART_FLOW_RTSCTS, on PORTE next to RXD0/TXD0.
+//  Both are active low like the RS-232 signals behind a USB serial adapter  //
+#define UART_RtsPin 4			//PE4 (pin 2), out - low while bytes can be taken
+#define UART_CtsPin 5			//PE5 (pin 3), in - low while the host takes bytes
+
+//  USART status bits returned by hal_uart_status  //
+#define HAL_UART_DATA_OVERRUN (1 << DOR0)
+#define HAL_UART_FRAME_ERROR  (1 << FE0)
+
+//  Stdio stream bound to a put/get function pair - used as a FILE*  //
+#define HAL_STREAM(name, put, get, flags) \
+	static FILE name##_FILE = FDEV_SETUP_STREAM(put, get, flags); \
+	static FILE* const name = &name##_FILE
+
+//  Delays - arguments must be compile time constants  //
+#define hal_delay_us(us) _delay_us(us)
+#define hal_delay_ms(ms) _delay_ms(ms)
+
+/*
+ * Function:	hal_wait
+ *  Called from busy-wait loops. Interrupts do the work on the AVR, so there
+ *  is nothing to do here.
+ *
+ *  returns:	none
+ */
+static inline void hal_wait(void){
+}
+
+//  Select idle sleep - timers and the USART keep running and wake the CPU  //
+static inline void hal_sleep_init(void){
+	set_sleep_mode(SLEEP_MODE_IDLE);
+}
+
+/*
+ * Function:	hal_sleep_idle
+ *  Sleeps until the next interrupt. Must be called with interrupts 
+ *  disabled after checking there is no work; the instruction after sei 
+ *  always runs, so an interrupt that posts work in between still wakes 
+ *  the CPU. Returns with interrupts enabled.
+ *
+ *  returns:	none
+ */
+static inline void hal_sleep_idle(void){
+	sleep_enable();
+	sei();
+	sleep_cpu();
+	sleep_disable();
+}
+
+/*
+ * Function:	hal_gpio_init
+ *  Sets the LCD data lines (PORTA, upper nybble in 4-bit mode), RS, E and the heartbeat
+ *  pin (PORTB) as outputs. RW is an output too in busy flag mode, and so 
+ *  are the PORTC E lines of any extra panels.
+ *
+ *  returns:	none
+ */
+static inline void hal_gpio_init(void){
+	DDRB = (1<<HeartbeatPin);	//setup pins in ports A and B as outputs
+	LCD_CTRL_DDR |= (1<<LCD_EnablePin) | (1<<LCD_RegisterSelectPin);
+	LCD_DATA_DDR |= LCD_DATA_MASK;
+#if LCD_USE_BUSY_FLAG
+	LCD_CTRL_DDR |= (1<<LCD_ReadWritePin);	//RW is driven low except for reads
+	LCD_CTRL_PORT &= ~(1<<LCD_ReadWritePin);
+#endif
+#if LCD_PANELS > 1
+	LCD_EXTRA_E_DDR |= ((1 << (LCD_PANELS - 1)) - 1) << LCD_ExtraEnablePin;	//E of panels 1 and up
+	LCD_EXTRA_E_PORT &= ~(((1 << (LCD_PANELS - 1)) - 1) << LCD_ExtraEnablePin);
+#endif
+}
+
+//  Put Data on the LCD data lines - all of it with LCD_BUS_8BIT, else its
+//  upper nybble on D4-D7  //
+static inline void hal_lcd_data(uint8_t Data){
+#if LCD_BUS_8BIT
+	uint8_t bits = Data;
+#else
+	uint8_t bits = (Data >> (4 - LCD_DATA_SHIFT)) & LCD_DATA_MASK;
+#endif
+#if LCD_DATA_PORT_OWNED
+	LCD_DATA_PORT = bits;	//one OUT - the other pins stay low, no pull-ups
+#else
+	LCD_DATA_PIN = (LCD_DATA_PORT ^ bits) & LCD_DATA_MASK;	//toggle the lines that differ
+#endif
+}
+
+//  Drive the LCD register select line  //
+static inline void hal_lcd_rs(uint8_t high){
+	if(high){
+		LCD_CTRL_PORT |= (1<<LCD_RegisterSelectPin);
+	}
+	else{
+		LCD_CTRL_PORT &= ~(1<<LCD_RegisterSelectPin);
+	}
+}
+
+//  Drive the enable line of one LCD panel  //
+static inline void hal_lcd_e(uint8_t panel, uint8_t high){
+#if LCD_PANELS > 1
+	if(panel != 0){
+		uint8_t mask = 1 << (LCD_ExtraEnablePin + panel - 1);
+		if(high){
+			LCD_EXTRA_E_PORT |= mask;
+		}
+		else{
+			LCD_EXTRA_E_PORT &= ~mask;
+		}
+		return;
+	}
+#endif
+	if(high){
+		LCD_CTRL_PORT |= (1<<LCD_EnablePin);
+	}
+	else{
+		LCD_CTRL_PORT &= ~(1<<LCD_EnablePin);
+	}
+}
+
+/*
+ * Function:	hal_lcd_e_pulse
+ *  Pulses the enable line of one LCD panel high and back low, so the panel
+ *  latches the data lines on the falling edge. E must be low on entry - it
+ *  is toggled through PINx, two OUTs with LCD_E_HIGH_CYCLES between them.
+ *  Returns LCD_E_LOW_CYCLES later, so the next pulse can follow at once
+ *  and still meet the E cycle time.
+ *
+ *  panel	uint8_t	LCD panel to pulse
+ *
+ *  returns:	none
+ */
+static inline void hal_lcd_e_pulse(uint8_t panel){
+#if LCD_PANELS > 1
+	if(panel != 0){
+		uint8_t mask = 1 << (LCD_ExtraEnablePin + panel - 1);
+		LCD_EXTRA_E_PIN = mask;		//E high
+		__builtin_avr_delay_cycles(LCD_E_HIGH_CYCLES);
+		LCD_EXTRA_E_PIN = mask;		//E low
+		__builtin_avr_delay_cycles(LCD_E_LOW_CYCLES);
+		return;
+	}
+#endif
+	LCD_CTRL_PIN = (1<<LCD_EnablePin);	//E high
+	__builtin_avr_delay_cycles(LCD_E_HIGH_CYCLES);
+	LCD_CTRL_PIN = (1<<LCD_EnablePin);	//E low
+	__builtin_avr_delay_cycles(LCD_E_LOW_CYCLES);
+}
+
+//  Drive the LCD read/write line (busy flag mode only)  //
+static inline void hal_lcd_rw(uint8_t high){
+	if(high){
+		LCD_CTRL_PORT |= (1<<LCD_ReadWritePin);
+	}
+	else{
+		LCD_CTRL_PORT &= ~(1<<LCD_ReadWritePin);
+	}
+}
+
+//  Switch the LCD data lines between output (write) and input (read)  //
+static inline void hal_lcd_data_dir(uint8_t output){
+	if(output){
+		LCD_DATA_DDR |= LCD_DATA_MASK;
+	}
+	else{
+		LCD_DATA_DDR &= (uint8_t)~LCD_DATA_MASK;
+		LCD_DATA_PORT &= (uint8_t)~LCD_DATA_MASK;	//no pull-ups on data lines
+	}
+}
+
+//  Read D7 - the busy flag while RW and E are high  //
+static inline uint8_t hal_lcd_busy_flag(void){
+	return LCD_DATA_PIN & (1 << LCD_DATA_D7);
+}
+
+//  Toggle the heartbeat pin - one OUT to PINB, so the LCD interrupt's RS and
+//  E writes to PORTB can never be undone by a read-modify-write here  //
+static inline void hal_heartbeat_toggle(void){
+	PINB = (1<<HeartbeatPin);
+}
+
+/*
+ * Function:	hal_timer0_init
+ *  Sets up timer0 in CTC mode with a 64 prescaler and enables the compare
+ *  match A interrupt, which fires every top + 1 timer counts. The hardware
+ *  reloads the count, so the period does not depend on interrupt latency.
+ *
+ *  top		uint8_t	value for OCR0A
+ *
+ *  returns:	none
+ */
+static inline void hal_timer0_init(uint8_t top){
+	TCCR0A = (1 << WGM01);			//CTC mode, TOP = OCR0A
+	TCCR0B = (1 << CS01) | (1 << CS00);	//64 prescaler
+	OCR0A = top;
+	TCNT0 = 0;
+	TIMSK0 = (1 << OCIE0A);			//enable compare match A interrupt
+}
+
+//  Current timer0 count, 0 to top  //
+static inline uint8_t hal_timer0_count(void){
+	return TCNT0;
+}
+
+//  Check for a timer0 compare match whose interrupt has not run yet  //
+static inline uint8_t hal_timer0_pending(void){
+	return TIFR0 & (1 << OCF0A);
+}
+
+/*
+ * Function:	hal_lcd_timer_init
+ *  Sets up timer2 in CTC mode with an 8 prescaler. The compare match A
+ *  interrupt fires every top + 1 timer counts once it is enabled.
+ *
+ *  top		uint8_t	value for OCR2A
+ *
+ *  returns:	none
+ */
+static inline void hal_lcd_timer_init(uint8_t top){
+	TCCR2A = (1 << WGM21);	//CTC mode, TOP = OCR2A
+	TCCR2B = (1 << CS21);	//8 prescaler
+	OCR2A = top;
+	TCNT2 = 0;
+}
+
+//  Restart timer2 from zero, drop a pending compare match and enable the interrupt  //
+static inline void hal_lcd_timer_start(void){
+	TCNT2 = 0;
+	TIFR2 = (1 << OCF2A);	//flag is cleared by writing a one
+	TIMSK2 |= (1 << OCIE2A);
+}
+
+//  Enable or disable the timer2 compare match A interrupt  //
+static inline void hal_lcd_timer_irq(uint8_t on){
+	if(on){
+		TIMSK2 |= (1 << OCIE2A);
+	}
+	else{
+		TIMSK2 &= ~(1 << OCIE2A);
+	}
+}
+
+//  Check if the timer2 compare match A interrupt is enabled  //
+static inline uint8_t hal_lcd_timer_irq_enabled(void){
+	return TIMSK2 & (1 << OCIE2A);
+}
+
+/*
+ * Function:	hal_backlight_init
+ *  Sets up timer4 in 8-bit fast PWM mode with an 8 prescaler (7.8 kHz) for
+ *  the backlight on OC4A (PH3). The output stays off until 
+ *  hal_backlight_set turns it on.
+ *
+ *  returns:	none
+ */
+static inline void hal_backlight_init(void){
+	DDRH |= (1 << PH3);
+	PORTH &= ~(1 << PH3);
+	TCCR4A = (1 << WGM40);			//fast PWM, TOP = 0xFF
+	TCCR4B = (1 << WGM42) | (1 << CS41);	//8 prescaler
+}
+
+//  Set the backlight duty cycle, 0 (off) to 255 (on). Fast PWM still gives a
+//  one count pulse at OCR4A = 0, so off disconnects OC4A from the pin  //
+static inline void hal_backlight_set(uint8_t level){
+	if(level == 0){
+		TCCR4A &= ~(1 << COM4A1);
+	}
+	else{
+		OCR4A = level;
+		TCCR4A |= (1 << COM4A1);	//clear on compare match, set at BOTTOM
+	}
+}
+
+//  USART register offsets from UCSRnA - the same for USART0-3  //
+#define HAL_UCSRA 0
+#define HAL_UCSRB 1
+#define HAL_UCSRC 2
+#define HAL_UBRRL 4
+#define HAL_UBRRH 5
+#define HAL_UDR   6
+
+//  First register of a USART port (UCSRnA). USART3 is not next to the others,
+//  so the address comes from a switch - with a constant port it folds away  //
+static inline volatile uint8_t* hal_uart_regs(uint8_t port){
+	switch(port){
+	case 1:
+		return &UCSR1A;
+	case 2:
+		return &UCSR2A;
+	case 3:
+		return &UCSR3A;
+	default:
+		return &UCSR0A;
+	}
+}
+
+/*
+ * Function:	hal_uart_init
+ *  Enables a USART's receive, transmit and receive complete interrupt,
+ *  selects 8 bit character frames in async mode and sets the baud rate.
+ *
+ *  port	uint8_t		USART number, 0 to 3
+ *  ubrr	uint16_t	baud rate register value
+ *  u2x		uint8_t		1 for double speed mode (8 samples per bit)
+ *
+ *  returns:	none
+ */
+static inline void hal_uart_init(uint8_t port, uint16_t ubrr, uint8_t u2x){
+	volatile uint8_t* regs = hal_uart_regs(port);
+
+	regs[HAL_UCSRA] = u2x ? (1 << U2X0) : 0;	//normal or double speed
+
+	regs[HAL_UCSRB] |= 0x18;		//Enable RX and TX
+	regs[HAL_UCSRB] |= (1 << RXCIE0);	//Enable receive complete interrupt
+	regs[HAL_UCSRC] |= 0x06;		//Use 8 bit character frames in async mode
+
+	//set baud rate (upper 4 bits should be zero)
+	regs[HAL_UBRRL] = ubrr;
+	regs[HAL_UBRRH] = (ubrr >> 8);
+}
+
+//  Read a USART's status - must be read before the data register  //
+static inline uint8_t hal_uart_status(uint8_t port){
+	return hal_uart_regs(port)[HAL_UCSRA];
+}
+
+//  Read the received byte from a USART  //
+static inline uint8_t hal_uart_read(uint8_t port){
+	return hal_uart_regs(port)[HAL_UDR];
+}
+
+//  Write the next byte to transmit on a USART  //
+static inline void hal_uart_write(uint8_t port, uint8_t c){
+	hal_uart_regs(port)[HAL_UDR] = c;
+}
+
+//  Enable or disable a USART's data register empty interrupt  //
+static inline void hal_uart_tx_irq(uint8_t port, uint8_t on){
+	if(on){
+		hal_uart_regs(port)[HAL_UCSRB] |= (1 << UDRIE0);
+	}
+	else{
+		hal_uart_regs(port)[HAL_UCSRB] &= ~(1 << UDRIE0);
+	}
+}
+
+//  Set up the USART0 handshake lines - RTS starts low (ready), CTS gets a 
+//  pull-up so an unwired CTS holds the output back instead of floating  //
+static inline void hal_uart_flow_init(void){
+	DDRE |= (1 << UART_RtsPin);
+	PORTE &= ~(1 << UART_RtsPin);
+	DDRE &= ~(1 << UART_CtsPin);
+	PORTE |= (1 << UART_CtsPin);
+}
+
+//  Tell the host on USART0 whether it may send - RTS low for ready  //
+static inline void hal_uart_rts(uint8_t ready){
+	if(ready){
+		PORTE &= ~(1 << UART_RtsPin);
+	}
+	else{
+		PORTE |= (1 << UART_RtsPin);
+	}
+}
+
+//  Check if the host on USART0 can take bytes - CTS is low  //
+static inline uint8_t hal_uart_cts(void){
+	return !(PINE & (1 << UART_CtsPin));
+}
+
+//  Check if the EEPROM is still programming the last byte written  //
+static inline uint8_t hal_eeprom_busy(void){
+	return EECR & (1 << EEPE);
+}
+
+//  Read an EEPROM byte - the CPU halts 4 cycles for it. Must not be called
+//  while hal_eeprom_busy(), the address can't change during a write  //
+static inline uint8_t hal_eeprom_read(uint16_t addr){
+	EEAR = addr;
+	EECR |= (1 << EERE);
+	return EEDR;
+}
+
+/*
+ * Function:	hal_eeprom_write
+ *  Starts an erase and write of one EEPROM byte, which takes 3.4 ms. 
+ *  EEPE has to be set within 4 cycles of EEMPE, so interrupts must be off
+ *  (as they are in an ISR) and the EEPROM must not be busy.
+ *
+ *  addr	uint16_t	byte address, 0 to HAL_EEPROM_SIZE - 1
+ *  data	uint8_t		value to write
+ *
+ *  returns:	none
+ */
+static inline void hal_eeprom_write(uint16_t addr, uint8_t data){
+	EEAR = addr;
+	EEDR = data;
+	EECR |= (1 << EEMPE);			//SBI, then SBI - 2 cycles apart
+	EECR |= (1 << EEPE);
+}
+
+//  Check if this start is from power on or a brown out - the LCDs lost 
+//  power too. MCUSR is read once and cleared. A bootloader that clears it
+//  first leaves it 0, which counts as power on  //
+static inline uint8_t hal_reset_power_on(void){
+	uint8_t cause = MCUSR;
+	
+	MCUSR = 0;
+	return cause == 0 || (cause & ((1 << PORF) | (1 << BORF))) != 0;
+}
+
+//  Benchmark marker - the simulator harness watches writes to GPIOR0  //
+static inline void hal_bench_mark(uint8_t op){
+	GPIOR0 = op;
+}
+
+#endif /* HAL_AVR_H_ */
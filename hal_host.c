@@ -0,0 +1,1045 @@
+/*
+ * hal_host.c - Linux backend for hal.h
+ * Description:	Runs the firmware in main.c on a Linux host. Provides:
+ *
+ *		- an emulated KS0066U controller on the LCD bus pins for
+ *		  each of the LCD_PANELS panels, selected by its E line. It
+ *		  latches data on the falling edge of E, runs an 8-bit bus
+ *		  (LCD_BUS_8BIT) or follows the 8-bit to 4-bit reset sequence, keeps DDRAM/CGRAM, the address
+ *		  counter, entry mode and display shift, and reports the
+ *		  busy flag. Writes that arrive while the controller is still
+ *		  busy, E pulses shorter than 230 ns, or E rising again
+ *		  within 500 ns, are counted as timing violations.
+ *		- USART0-3, each served on its own pty once the firmware
+ *		  enables it, or fed from a file when the LCD_HOST_INPUT
+ *		  environment variable is set ("-" reads stdin). In file
+ *		  mode USART1-3 read LCD_HOST_INPUT1-3 and write to stdout.
+ *		  Bytes are paced at the configured baud rate. With
+ *		  UART_FLOW set, USART0 input stops while the firmware has
+ *		  sent XOFF or raised RTS, and CTS always reads clear.
+ *		- timer0 and timer2 compare interrupts, and the timer4
+ *		  backlight PWM level.
+ *		- the 4 KB EEPROM, erased (0xFF) at start, or kept in the
+ *		  file named by LCD_HOST_EEPROM so it lasts from one run to
+ *		  the next. Each byte written keeps it busy for 3.4 ms, and
+ *		  an access while it is busy is a timing violation.
+ *		- the reset cause. A run is a power on reset, unless
+ *		  LCD_HOST_WARM is set. Then the LCDs start powered up and
+ *		  in 4-bit mode, waiting for the low nybble of a byte, as
+ *		  after a reset button press in the middle of a write.
+ *
+ *		Time is emulated. It only moves forward through delays and
+ *		through hal_wait(), which jumps straight to the next due
+ *		interrupt. In pty mode it follows the real clock while the
+ *		firmware waits on serial input. In file mode the run ends
+ *		once the input is used up and the firmware has been idle for
+ *		a second, or for LCD_HOST_IDLE_MS. The final display contents
+ *		and bus statistics are then printed to stderr.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+
+#include "hal.h"
+#include "lcd_geometry.h"
+
+#define HOST_F_CPU 16000000ULL
+#define HOST_NEVER UINT64_MAX
+#define HOST_IDLE_EXIT_NS 1000000000ULL	//file mode ends after 1 s idle
+
+#ifndef HOST_LCD_ROWS
+#define HOST_LCD_ROWS LCD_ROWS
+#endif
+#ifndef HOST_LCD_COLS
+#define HOST_LCD_COLS LCD_COLS
+#endif
+
+//  KS0066U timings (fosc = 270 kHz)  //
+#define LCD_EXEC_NS 37000ULL		//most instructions
+#define LCD_DATA_NS 41000ULL		//data write, 37 us + 4 us
+#define LCD_CLEAR_NS 1520000ULL		//clear display, return home
+#define LCD_POWERUP_NS 40000000ULL	//Vdd rise to first instruction
+#define LCD_PW_EH_NS 230ULL		//minimum enable pulse width
+#define LCD_CYC_E_NS 500ULL		//minimum enable cycle time
+
+//  Interrupt handlers defined in main.c with ISR()  //
+void hal_isr_TIMER0_COMPA_vect(void);
+void hal_isr_TIMER2_COMPA_vect(void);
+void hal_isr_USART0_RX_vect(void);
+void hal_isr_USART0_UDRE_vect(void);
+
+//  USART1-3 handlers only exist when main.c enables those ports  //
+void hal_isr_USART1_RX_vect(void) __attribute__((weak));
+void hal_isr_USART1_UDRE_vect(void) __attribute__((weak));
+void hal_isr_USART2_RX_vect(void) __attribute__((weak));
+void hal_isr_USART2_UDRE_vect(void) __attribute__((weak));
+void hal_isr_USART3_RX_vect(void) __attribute__((weak));
+void hal_isr_USART3_UDRE_vect(void) __attribute__((weak));
+
+#define HOST_UARTS 4
+
+static uint64_t hostNs = 0;		//emulated time since reset
+static uint64_t hostIdleNs = 0;		//time of last serial or LCD activity
+static uint64_t hostIdleExitNs = HOST_IDLE_EXIT_NS;	//idle time that ends a file run
+static uint64_t hostStartNs = 0;	//real clock at reset (pty mode)
+static uint8_t hostIrqOn = 0;		//global interrupt enable
+static uint8_t hostInIsr = 0;		//an interrupt handler is running
+static uint8_t hostReady = 0;		//host_setup has run
+static uint8_t hostFileMode = 0;	//serial input comes from a file
+static uint8_t hostBacklight = 0;	//OC4A duty cycle, 0-255
+static uint8_t hostWarm = 0;		//LCDs kept power through the reset
+
+//  Emulated EEPROM  //
+static struct {
+	uint8_t data[HAL_EEPROM_SIZE];
+	uint64_t busyUntil;	//EEPE clears
+	int fd;			//LCD_HOST_EEPROM file, or -1
+	unsigned long writes;
+	unsigned long violations;
+} eeprom;
+
+//  Emulated KS0066U state, one per panel  //
+struct host_lcd {
+	uint8_t ddram[0x80];
+	uint8_t cgram[0x40];
+	uint8_t ac;		//address counter
+	uint8_t cgMode;		//AC points into CGRAM
+	uint8_t eightBit;	//interface data length
+	uint8_t lowNext;	//4-bit mode - next nybble is the low one
+	uint8_t high;		//4-bit mode - latched high nybble
+	uint8_t increment;	//entry mode I/D
+	uint8_t shiftOnWrite;	//entry mode S
+	uint8_t displayOn;
+	uint8_t twoLine;
+	uint8_t shift;		//display shift, 0-39
+	uint8_t rs, rw, e, bus, busOut;
+	uint8_t readValue;	//BF and AC latched for a read
+	uint64_t eRiseNs;
+	uint64_t busyUntil;
+	uint8_t dirty;		//display changed since last render
+	unsigned long instructions;
+	unsigned long chars;
+	unsigned long cgChars;	//chars written to CGRAM
+	unsigned long violations;
+};
+static struct host_lcd lcdPanels[LCD_PANELS];
+static struct host_lcd* lcd = &lcdPanels[0];	//panel being clocked or drawn
+
+//  Emulated timers  //
+static struct {
+	uint8_t irq;		//OCIE0A
+	uint8_t top;		//OCR0A
+	uint64_t period;	//ns between compare matches
+	uint64_t next;		//next compare match
+} timer0;
+
+static struct {
+	uint8_t running;
+	uint8_t irq;		//OCIE2A
+	uint8_t flag;		//OCF2A - compare happened with irq off
+	uint64_t period;
+	uint64_t next;		//next compare match
+} timer2;
+
+//  Emulated USARTs  //
+static struct host_uart {
+	uint8_t enabled;
+	uint64_t byteNs;	//one 10 bit frame
+	uint8_t rxData;
+	uint64_t rxNext;	//earliest time of the next received byte
+	uint8_t txIrq;		//UDRIEn
+	uint8_t txWrote;	//UDRE handler loaded UDRn
+	uint64_t txNext;	//UDRn empty again
+	int inFd;
+	int outFd;
+	int eof;
+	uint8_t stopped;	//firmware sent XOFF or raised RTS
+	uint8_t fifo[256];	//bytes waiting on the line
+	uint16_t head;
+	uint16_t tail;
+	unsigned long bytesIn;
+	unsigned long bytesOut;
+	void (*rxVect)(void);
+	void (*udreVect)(void);
+} uarts[HOST_UARTS] = {
+	{ .rxVect = hal_isr_USART0_RX_vect, .udreVect = hal_isr_USART0_UDRE_vect },
+	{ .rxVect = hal_isr_USART1_RX_vect, .udreVect = hal_isr_USART1_UDRE_vect },
+	{ .rxVect = hal_isr_USART2_RX_vect, .udreVect = hal_isr_USART2_UDRE_vect },
+	{ .rxVect = hal_isr_USART3_RX_vect, .udreVect = hal_isr_USART3_UDRE_vect },
+};
+
+static uint64_t host_real_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//  Shade for a CGRAM char by the share of its 40 dots that are on  //
+static char lcd_glyph_shade(uint8_t ch){
+	const uint8_t* rows = &lcd->cgram[(ch & 0x07) << 3];
+	int dots = 0;
+
+	for(int r = 0; r < 8; r++){
+		for(uint8_t bit = 0x10; bit != 0; bit >>= 1){
+			dots += (rows[r] & bit) != 0;
+		}
+	}
+	return " .:+#"[(dots + 9) / 10];
+}
+
+/*
+ * Function:	lcd_render
+ *  Prints the visible part of DDRAM in a box. CGRAM chars (0x00-0x0F) 
+ *  show as ' ', '.', ':', '+' or '#' by how many of their dots are on, the
+ *  ROM block 0xFF as '#', and other unprintable chars as '?'.
+ *
+ *  out		FILE*	stream to print to
+ *
+ *  returns:	none
+ */
+static void lcd_render(FILE* out){
+	int r, c;
+
+	if(LCD_PANELS > 1){
+		fprintf(out, "panel %d\n", (int)(lcd - lcdPanels));
+	}
+	fputc('+', out);
+	for(c = 0; c < HOST_LCD_COLS; c++) fputc('-', out);
+	fputs("+\n", out);
+	for(r = 0; r < HOST_LCD_ROWS; r++){
+		uint8_t line = (r & 1) ? 0x40 : 0x00;
+		uint8_t offset = (r >= 2) ? HOST_LCD_COLS : 0;
+
+		fputc('|', out);
+		for(c = 0; c < HOST_LCD_COLS; c++){
+			uint8_t ch = lcd->ddram[line + (offset + c + lcd->shift) % 40];
+			if(!lcd->displayOn) ch = ' ';
+			if(ch < 0x10) ch = lcd_glyph_shade(ch);
+			else if(ch == 0xFF) ch = '#';	//ROM block
+			else if(ch < 0x20 || ch > 0x7E) ch = '?';
+			fputc(ch, out);
+		}
+		fputs("|\n", out);
+	}
+	fputc('+', out);
+	for(c = 0; c < HOST_LCD_COLS; c++) fputc('-', out);
+	fputs("+\n", out);
+	fflush(out);
+	lcd->dirty = 0;
+}
+
+//  Print every panel that changed since it was last printed  //
+static void host_render_dirty(void){
+	for(lcd = lcdPanels; lcd < lcdPanels + LCD_PANELS; lcd++){
+		if(lcd->dirty){
+			lcd_render(stderr);
+		}
+	}
+	lcd = lcdPanels;
+}
+
+//  Move the address counter one step in the entry mode direction  //
+static void lcd_step_ac(uint8_t forward){
+	if(lcd->cgMode){
+		lcd->ac = (lcd->ac + (forward ? 1 : -1)) & 0x3F;
+	}
+	else if(lcd->twoLine){
+		if(forward){
+			lcd->ac = (lcd->ac == 0x27) ? 0x40 : (lcd->ac == 0x67) ? 0x00 : lcd->ac + 1;
+		}
+		else{
+			lcd->ac = (lcd->ac == 0x00) ? 0x67 : (lcd->ac == 0x40) ? 0x27 : lcd->ac - 1;
+		}
+	}
+	else{
+		if(forward){
+			lcd->ac = (lcd->ac >= 0x4F) ? 0x00 : lcd->ac + 1;
+		}
+		else{
+			lcd->ac = (lcd->ac == 0x00) ? 0x4F : lcd->ac - 1;
+		}
+	}
+}
+
+//  Shift the display window one position  //
+static void lcd_shift_display(uint8_t right){
+	lcd->shift = right ? (lcd->shift + 39) % 40 : (lcd->shift + 1) % 40;
+	lcd->dirty = 1;
+}
+
+/*
+ * Function:	lcd_execute
+ *  Runs one full byte written to the controller.
+ *
+ *  b		uint8_t	instruction or data byte
+ *
+ *  returns:	none
+ */
+static void lcd_execute(uint8_t b){
+	uint64_t exec = LCD_EXEC_NS;
+
+	if(hostNs < lcd->busyUntil){	//controller not ready yet
+		lcd->violations++;
+	}
+	hostIdleNs = hostNs;
+
+	if(lcd->rs){			//data write
+		if(lcd->cgMode){
+			lcd->cgram[lcd->ac & 0x3F] = b & 0x1F;
+			lcd->cgChars++;
+		}
+		else{
+			lcd->ddram[lcd->ac] = b;
+		}
+		lcd_step_ac(lcd->increment);
+		if(lcd->shiftOnWrite && !lcd->cgMode){
+			lcd_shift_display(!lcd->increment);
+		}
+		lcd->chars++;
+		lcd->dirty = 1;
+		lcd->busyUntil = hostNs + LCD_DATA_NS;
+		return;
+	}
+
+	lcd->instructions++;
+	if(b & 0x80){			//set DDRAM address
+		lcd->cgMode = 0;
+		lcd->ac = b & 0x7F;
+	}
+	else if(b & 0x40){		//set CGRAM address
+		lcd->cgMode = 1;
+		lcd->ac = b & 0x3F;
+	}
+	else if(b & 0x20){		//function set
+		lcd->eightBit = (b & 0x10) != 0;
+		lcd->twoLine = (b & 0x08) != 0;
+		lcd->lowNext = 0;
+	}
+	else if(b & 0x10){		//cursor or display shift
+		if(b & 0x08){
+			lcd_shift_display((b & 0x04) != 0);
+		}
+		else{
+			lcd_step_ac((b & 0x04) != 0);
+		}
+	}
+	else if(b & 0x08){		//display on/off control
+		lcd->displayOn = (b & 0x04) != 0;
+		lcd->dirty = 1;
+	}
+	else if(b & 0x04){		//entry mode set
+		lcd->increment = (b & 0x02) != 0;
+		lcd->shiftOnWrite = (b & 0x01) != 0;
+	}
+	else if(b & 0x02){		//return home
+		lcd->cgMode = 0;
+		lcd->ac = 0;
+		lcd->shift = 0;
+		lcd->dirty = 1;
+		exec = LCD_CLEAR_NS;
+	}
+	else if(b & 0x01){		//clear display
+		memset(lcd->ddram, ' ', sizeof(lcd->ddram));
+		lcd->cgMode = 0;
+		lcd->ac = 0;
+		lcd->shift = 0;
+		lcd->increment = 1;
+		lcd->dirty = 1;
+		exec = LCD_CLEAR_NS;
+	}
+	lcd->busyUntil = hostNs + exec;
+}
+
+//  Falling edge of E - latch the bus  //
+static void lcd_latch(void){
+	if(hostNs - lcd->eRiseNs < LCD_PW_EH_NS){
+		lcd->violations++;
+	}
+	if(lcd->rw){			//read - only the nybble phase matters
+		if(!lcd->eightBit){
+			lcd->lowNext ^= 1;
+		}
+		return;
+	}
+	if(lcd->eightBit){		//D0-D3 read low unless LCD_BUS_8BIT wires them
+		lcd_execute(lcd->bus);
+	}
+	else if(!lcd->lowNext){
+		lcd->high = lcd->bus & 0xF0;
+		lcd->lowNext = 1;
+	}
+	else{
+		lcd->lowNext = 0;
+		lcd_execute(lcd->high | (lcd->bus >> 4));
+	}
+}
+
+/*
+ * Function:	host_open_pty
+ *  Opens a pty for a USART and prints the name of the slave side for a
+ *  terminal program to connect to. The slave is held open so the master
+ *  does not see a hang-up while no terminal is connected.
+ *
+ *  port	uint8_t		USART number, 0 to 3
+ *
+ *  returns:	none
+ */
+static void host_open_pty(uint8_t port){
+	struct termios tio;
+	int slave;
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if(fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0){
+		perror("lcd_host: pty");
+		exit(1);
+	}
+	slave = open(ptsname(fd), O_RDWR | O_NOCTTY);
+	if(slave >= 0 && tcgetattr(slave, &tio) == 0){
+		cfmakeraw(&tio);
+		tcsetattr(slave, TCSANOW, &tio);
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	fprintf(stderr, "lcd_host: USART%u on %s\n", port, ptsname(fd));
+	uarts[port].inFd = fd;
+	uarts[port].outFd = fd;
+}
+
+//  Connects a USART to its input file (file mode) or to a new pty  //
+static void host_open_uart(uint8_t port){
+	struct host_uart* uart = &uarts[port];
+	char name[] = "LCD_HOST_INPUT0";
+	const char* input;
+
+	if(!hostFileMode){
+		host_open_pty(port);
+		return;
+	}
+	if(port != 0){
+		name[sizeof(name) - 2] = '0' + port;
+	}
+	else{
+		name[sizeof(name) - 2] = '\0';
+	}
+	input = getenv(name);
+	uart->outFd = 1;
+	if(input == NULL){
+		uart->inFd = -1;		//no input for this port
+		uart->eof = 1;
+		return;
+	}
+	uart->inFd = (strcmp(input, "-") == 0) ? 0 : open(input, O_RDONLY);
+	if(uart->inFd < 0){
+		perror(input);
+		exit(1);
+	}
+}
+
+//  One time setup of the emulator and the serial connection  //
+static void host_setup(void){
+	if(hostReady){
+		return;
+	}
+	hostReady = 1;
+	hostWarm = getenv("LCD_HOST_WARM") != NULL;
+
+	for(lcd = lcdPanels; lcd < lcdPanels + LCD_PANELS; lcd++){
+		memset(lcd->ddram, ' ', sizeof(lcd->ddram));
+		lcd->eightBit = 1;
+		lcd->increment = 1;
+		lcd->busOut = 1;
+		lcd->busyUntil = LCD_POWERUP_NS;
+		if(hostWarm){		//up, 4 bits, reset between two nybbles
+			lcd->eightBit = LCD_BUS_8BIT;
+			lcd->lowNext = !LCD_BUS_8BIT;
+			lcd->busyUntil = 0;
+		}
+	}
+	lcd = lcdPanels;
+
+	timer0.next = HOST_NEVER;
+
+	memset(eeprom.data, 0xFF, sizeof(eeprom.data));
+	eeprom.fd = -1;
+	if(getenv("LCD_HOST_EEPROM") != NULL){
+		eeprom.fd = open(getenv("LCD_HOST_EEPROM"), O_RDWR | O_CREAT, 0644);
+		if(eeprom.fd < 0){
+			perror("lcd_host: LCD_HOST_EEPROM");
+			exit(2);
+		}
+		ssize_t n = read(eeprom.fd, eeprom.data, sizeof(eeprom.data));
+
+		if(n < 0){
+			n = 0;
+		}
+		if((size_t)n < sizeof(eeprom.data)){	//new file - erase the rest
+			memset(eeprom.data + n, 0xFF, sizeof(eeprom.data) - n);
+			if(pwrite(eeprom.fd, eeprom.data + n, sizeof(eeprom.data) - n, n) < 0){
+				perror("lcd_host: LCD_HOST_EEPROM");
+			}
+		}
+	}
+
+	hostFileMode = getenv("LCD_HOST_INPUT") != NULL;
+	if(getenv("LCD_HOST_IDLE_MS") != NULL){
+		hostIdleExitNs = strtoull(getenv("LCD_HOST_IDLE_MS"), NULL, 10) * 1000000ULL;
+	}
+	if(!hostFileMode){
+		hostStartNs = host_real_ns();
+	}
+}
+
+/*
+ * Function:	host_finish
+ *  Ends a file mode run - prints the display and the statistics.
+ *
+ *  returns:	none
+ */
+static void host_finish(void){
+	unsigned long instructions = 0, chars = 0, cgChars = 0, violations = 0;
+	unsigned long bytesIn = 0, bytesOut = 0;
+	uint8_t port;
+
+	for(lcd = lcdPanels; lcd < lcdPanels + LCD_PANELS; lcd++){
+		lcd_render(stderr);
+		instructions += lcd->instructions;
+		chars += lcd->chars;
+		cgChars += lcd->cgChars;
+		violations += lcd->violations;
+	}
+	violations += eeprom.violations;
+	for(port = 0; port < HOST_UARTS; port++){
+		bytesIn += uarts[port].bytesIn;
+		bytesOut += uarts[port].bytesOut;
+	}
+	fprintf(stderr, "lcd_host: %.3f ms emulated, %lu serial bytes in, %lu out\n",
+		hostNs / 1e6, bytesIn, bytesOut);
+	fprintf(stderr, "lcd_host: %lu LCD instructions, %lu chars (%lu to CGRAM), %lu timing violations\n",
+		instructions, chars, cgChars, violations);
+	fprintf(stderr, "lcd_host: backlight %u/255\n", hostBacklight);
+	fprintf(stderr, "lcd_host: %lu EEPROM bytes written, %lu EEPROM violations\n",
+		eeprom.writes, eeprom.violations);
+	exit(violations != 0);
+}
+
+//  Read whatever serial input is available into a USART's line fifo  //
+static void host_read_port(struct host_uart* uart, int block){
+	uint8_t buf[256];
+	ssize_t n;
+	ssize_t i;
+	uint16_t space = sizeof(uart->fifo) - (uint16_t)(uart->head - uart->tail);
+
+	if(!uart->enabled || uart->eof || space == 0){
+		return;
+	}
+	if(!block && hostFileMode && uart->head != uart->tail){
+		return;			//file mode only refills an empty fifo
+	}
+	n = read(uart->inFd, buf, space < sizeof(buf) ? space : sizeof(buf));
+	if(n == 0 && hostFileMode){
+		uart->eof = 1;
+		return;
+	}
+	for(i = 0; i < n; i++){
+		uart->fifo[uart->head++ & 0xFF] = buf[i];
+	}
+	if(n > 0 && uart->rxNext < hostNs){
+		uart->rxNext = hostNs;
+	}
+}
+
+//  Read the input of every enabled USART  //
+static void host_read_input(int block){
+	struct host_uart* uart;
+
+	for(uart = uarts; uart < uarts + HOST_UARTS; uart++){
+		host_read_port(uart, block);
+	}
+}
+
+//  A file mode USART has nothing more to receive or send  //
+static int host_uart_done(const struct host_uart* uart){
+	return !uart->enabled || (uart->eof && uart->head == uart->tail && !uart->txIrq);
+}
+
+//  Call an interrupt handler  //
+static void host_isr(void (*handler)(void)){
+	hostInIsr = 1;
+	handler();
+	hostInIsr = 0;
+}
+
+//  Time the next interrupt is due, HOST_NEVER if none  //
+static uint64_t host_next_event(void){
+	uint64_t next = HOST_NEVER;
+	struct host_uart* uart;
+
+	if(!hostIrqOn){
+		return next;
+	}
+	if(timer2.running && timer2.irq){
+		uint64_t t = timer2.flag ? hostNs : timer2.next;
+		if(t < next) next = t;
+	}
+	if(timer0.irq && timer0.next < next){
+		next = timer0.next;
+	}
+	for(uart = uarts; uart < uarts + HOST_UARTS; uart++){
+		if(uart->enabled && uart->head != uart->tail && !uart->stopped){
+			uint64_t t = uart->rxNext > hostNs ? uart->rxNext : hostNs;
+			if(t < next) next = t;
+		}
+		if(uart->enabled && uart->txIrq){
+			uint64_t t = uart->txNext > hostNs ? uart->txNext : hostNs;
+			if(t < next) next = t;
+		}
+	}
+	return next;
+}
+
+/*
+ * Function:	host_fire_due
+ *  Runs every interrupt that is due at the current time, in AVR vector
+ *  priority order (TIMER2_COMPA, TIMER0_COMPA, then USART0-3 in port
+ *  order, RX before UDRE).
+ *
+ *  returns:	none
+ */
+static void host_fire_due(void){
+	uint8_t fired = 1;
+	struct host_uart* uart;
+
+	//keep timer2 counting while its interrupt is off
+	if(timer2.running && !timer2.irq && timer2.next <= hostNs){
+		timer2.next += ((hostNs - timer2.next) / timer2.period + 1) * timer2.period;
+		timer2.flag = 1;
+	}
+
+	while(fired && hostIrqOn){
+		fired = 0;
+		if(timer2.running && timer2.irq && (timer2.flag || timer2.next <= hostNs)){
+			if(timer2.next <= hostNs){
+				timer2.next += timer2.period;
+			}
+			timer2.flag = 0;
+			host_isr(hal_isr_TIMER2_COMPA_vect);
+			fired = 1;
+		}
+		else if(timer0.irq && timer0.next <= hostNs){
+			timer0.next += timer0.period;
+			host_isr(hal_isr_TIMER0_COMPA_vect);
+			fired = 1;
+		}
+		else{
+			for(uart = uarts; uart < uarts + HOST_UARTS && !fired; uart++){
+				if(uart->enabled && uart->head != uart->tail && !uart->stopped
+				   && uart->rxNext <= hostNs){
+					uart->rxData = uart->fifo[uart->tail++ & 0xFF];
+					uart->rxNext = hostNs + uart->byteNs;
+					uart->bytesIn++;
+					hostIdleNs = hostNs;
+					host_isr(uart->rxVect);
+					fired = 1;
+				}
+				else if(uart->enabled && uart->txIrq && uart->txNext <= hostNs){
+					uart->txWrote = 0;
+					host_isr(uart->udreVect);
+					if(uart->txWrote){
+						uart->txNext = hostNs + uart->byteNs;
+					}
+					fired = 1;
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Function:	host_step
+ *  Moves emulated time to the next due interrupt (or to limit, whichever
+ *  is first) and runs what is due. In pty mode emulated time does not run
+ *  ahead of the real clock - waits are spent blocked on the pty, so typed
+ *  input arrives as it would on the board.
+ *
+ *  limit	uint64_t	latest time to move to
+ *
+ *  returns:	none
+ */
+static void host_step(uint64_t limit){
+	uint64_t next;
+	uint8_t port;
+
+	host_read_input(0);
+	next = host_next_event();
+	if(next > limit){
+		next = limit;
+	}
+
+	if(hostFileMode){
+		uint8_t done = 1;
+
+		for(port = 0; port < HOST_UARTS; port++){
+			done &= host_uart_done(&uarts[port]);
+		}
+		if(done && !timer2.irq && hostNs - hostIdleNs >= hostIdleExitNs){
+			host_finish();
+		}
+		if(next == HOST_NEVER){
+			done = 1;
+			for(port = 0; port < HOST_UARTS; port++){
+				done &= !uarts[port].enabled || uarts[port].eof;
+			}
+			if(done){
+				host_finish();
+			}
+			host_read_input(1);	//nothing else can happen
+			return;
+		}
+		if(hostNs < next){
+			hostNs = next;
+		}
+	}
+	else{
+		uint64_t real = host_real_ns() - hostStartNs;
+
+		if(!timer2.irq){
+			host_render_dirty();
+		}
+		if(next > real){	//wait in real time, or until input
+			struct pollfd pfd[HOST_UARTS];
+			nfds_t n = 0;
+			uint64_t wait = next - real;
+			struct timespec ts;
+
+			for(port = 0; port < HOST_UARTS; port++){
+				if(uarts[port].enabled){
+					pfd[n].fd = uarts[port].inFd;
+					pfd[n].events = POLLIN;
+					pfd[n++].revents = 0;
+				}
+			}
+			if(wait > 100000000ULL){
+				wait = 100000000ULL;
+			}
+			ts.tv_sec = 0;
+			ts.tv_nsec = wait;
+			ppoll(pfd, n, &ts, NULL);
+			real = host_real_ns() - hostStartNs;
+			host_read_input(0);
+		}
+		if(hostNs < real){
+			hostNs = real < next ? real : next;
+		}
+	}
+	host_fire_due();
+}
+
+struct host_stream {
+	int (*put)(char, FILE*);
+	int (*get)(FILE*);
+	FILE* file;
+};
+
+static ssize_t host_stream_write(void* cookie, const char* buf, size_t size){
+	struct host_stream* s = cookie;
+	size_t i;
+
+	for(i = 0; i < size; i++){
+		s->put(buf[i], s->file);
+	}
+	return size;
+}
+
+static ssize_t host_stream_read(void* cookie, char* buf, size_t size){
+	struct host_stream* s = cookie;
+	int c;
+
+	if(size == 0){
+		return 0;
+	}
+	c = s->get(s->file);
+	if(c < 0){
+		return 0;
+	}
+	buf[0] = (char)c;
+	return 1;
+}
+
+/*
+ * Function:	hal_host_stream
+ *  Opens an unbuffered stdio stream that calls put for every char written
+ *  and get for every char read, like an avr-libc FDEV_SETUP_STREAM.
+ *
+ *  returns:	FILE*	the new stream
+ */
+FILE* hal_host_stream(int (*put)(char, FILE*), int (*get)(FILE*)){
+	struct host_stream* s = calloc(1, sizeof(*s));
+	cookie_io_functions_t io = { NULL, NULL, NULL, NULL };
+
+	io.read = get ? host_stream_read : NULL;
+	io.write = put ? host_stream_write : NULL;
+	s->put = put;
+	s->get = get;
+	s->file = fopencookie(s, (put && get) ? "r+" : put ? "w" : "r", io);
+	setvbuf(s->file, NULL, _IONBF, 0);
+	return s->file;
+}
+
+void hal_irq_enable(void){
+	hostIrqOn = 1;
+}
+
+void hal_irq_disable(void){
+	hostIrqOn = 0;
+}
+
+void hal_wait(void){
+	host_setup();
+	host_step(HOST_NEVER);
+}
+
+void hal_sleep_init(void){
+}
+
+//  Idle sleep - enable interrupts and move on to the next emulated event  //
+void hal_sleep_idle(void){
+	hal_irq_enable();
+	hal_wait();
+}
+
+//  Let ns of emulated time pass, running the interrupts that fall due  //
+static void host_delay_ns(uint64_t ns){
+	uint64_t target = hostNs + ns;
+
+	if(hostInIsr){			//interrupts cannot nest
+		hostNs = target;
+		return;
+	}
+	host_setup();
+	while(hostNs < target){
+		host_step(target);
+	}
+}
+
+void hal_delay_us(uint32_t us){
+	host_delay_ns((uint64_t)us * 1000ULL);
+}
+
+void hal_delay_ms(uint32_t ms){
+	hal_delay_us(ms * 1000UL);
+}
+
+void hal_gpio_init(void){
+	host_setup();
+}
+
+//  D4-D7 (D0-D7 with LCD_BUS_8BIT), RS and RW are wired to every panel  //
+void hal_lcd_data(uint8_t Data){
+	for(int i = 0; i < LCD_PANELS; i++){
+		lcdPanels[i].bus = LCD_BUS_8BIT ? Data : Data & 0xF0;
+	}
+}
+
+void hal_lcd_rs(uint8_t high){
+	for(int i = 0; i < LCD_PANELS; i++){
+		lcdPanels[i].rs = high != 0;
+	}
+}
+
+void hal_lcd_e(uint8_t panel, uint8_t high){
+	lcd = &lcdPanels[panel];
+	high = high != 0;
+	if(high && !lcd->e){
+		if(lcd->eRiseNs != 0 && hostNs - lcd->eRiseNs < LCD_CYC_E_NS){
+			lcd->violations++;
+		}
+		lcd->eRiseNs = hostNs;
+		if(lcd->rw){		//BF and AC go out while E is high
+			lcd->readValue = (hostNs < lcd->busyUntil ? 0x80 : 0x00) | (lcd->ac & 0x7F);
+		}
+	}
+	else if(!high && lcd->e){
+		lcd_latch();
+	}
+	lcd->e = high;
+}
+
+//  E high for HAL_LCD_E_HIGH_NS, then low until the E cycle is over  //
+void hal_lcd_e_pulse(uint8_t panel){
+	hal_lcd_e(panel, 1);
+	host_delay_ns(HAL_LCD_E_HIGH_NS);
+	hal_lcd_e(panel, 0);
+	host_delay_ns(HAL_LCD_E_CYCLE_NS - HAL_LCD_E_HIGH_NS);
+}
+
+void hal_lcd_rw(uint8_t high){
+	for(int i = 0; i < LCD_PANELS; i++){
+		lcdPanels[i].rw = high != 0;
+	}
+}
+
+void hal_lcd_data_dir(uint8_t output){
+	for(int i = 0; i < LCD_PANELS; i++){
+		lcdPanels[i].busOut = output != 0;
+	}
+}
+
+//  Only the panel whose E was raised last drives the data lines  //
+uint8_t hal_lcd_busy_flag(void){
+	uint8_t value;
+
+	if(!lcd->rw || !lcd->e || lcd->busOut){
+		return 0;
+	}
+	value = lcd->lowNext ? (uint8_t)(lcd->readValue << 4) : lcd->readValue;
+	return value & 0x80;
+}
+
+void hal_heartbeat_toggle(void){
+}
+
+void hal_timer0_init(uint8_t top){
+	host_setup();
+	timer0.irq = 1;
+	timer0.top = top;
+	timer0.period = (top + 1ULL) * 64 * 1000000000ULL / HOST_F_CPU;
+	timer0.next = hostNs + timer0.period;
+}
+
+//  Count from the time since the last compare match  //
+uint8_t hal_timer0_count(void){
+	uint64_t since;
+
+	if(!timer0.irq || hostNs >= timer0.next){	//stopped, or wrapped
+		return 0;
+	}
+	since = timer0.period - (timer0.next - hostNs);
+	return since * (timer0.top + 1ULL) / timer0.period;
+}
+
+uint8_t hal_timer0_pending(void){
+	return timer0.irq && hostNs >= timer0.next;
+}
+
+void hal_lcd_timer_init(uint8_t top){
+	host_setup();
+	timer2.running = 1;
+	timer2.period = ((uint64_t)top + 1) * 8 * 1000000000ULL / HOST_F_CPU;
+	timer2.next = hostNs + timer2.period;
+}
+
+void hal_lcd_timer_start(void){
+	timer2.next = hostNs + timer2.period;
+	timer2.flag = 0;
+	timer2.irq = 1;
+}
+
+void hal_lcd_timer_irq(uint8_t on){
+	timer2.irq = on != 0;
+}
+
+uint8_t hal_lcd_timer_irq_enabled(void){
+	return timer2.irq;
+}
+
+void hal_backlight_init(void){
+	hostBacklight = 0;
+}
+
+void hal_backlight_set(uint8_t level){
+	hostBacklight = level;
+}
+
+void hal_uart_init(uint8_t port, uint16_t ubrr, uint8_t u2x){
+	struct host_uart* uart = &uarts[port];
+
+	host_setup();
+	if(!uart->enabled){
+		host_open_uart(port);
+	}
+	uart->enabled = 1;
+	uart->byteNs = 10ULL * (u2x ? 8 : 16) * ((uint64_t)ubrr + 1) * 1000000000ULL / HOST_F_CPU;
+}
+
+uint8_t hal_uart_status(uint8_t port){
+	(void)port;
+	return 0;
+}
+
+uint8_t hal_uart_read(uint8_t port){
+	return uarts[port].rxData;
+}
+
+void hal_uart_write(uint8_t port, uint8_t c){
+	struct host_uart* uart = &uarts[port];
+
+	uart->txWrote = 1;
+	uart->bytesOut++;
+	hostIdleNs = hostNs;
+	if(UART_FLOW == UART_FLOW_XONXOFF && port == 0 && (c == UART_XOFF || c == UART_XON)){
+		uart->stopped = c == UART_XOFF;	//sender stops at the next byte
+	}
+	if(write(uart->outFd, &c, 1) < 0){
+		//no terminal connected to the pty, drop the byte
+	}
+}
+
+void hal_uart_tx_irq(uint8_t port, uint8_t on){
+	uarts[port].txIrq = on != 0;
+}
+
+void hal_uart_flow_init(void){
+}
+
+void hal_uart_rts(uint8_t ready){
+	uarts[0].stopped = !ready;
+}
+
+uint8_t hal_uart_cts(void){
+	return 1;
+}
+
+uint8_t hal_eeprom_busy(void){
+	return hostNs < eeprom.busyUntil;
+}
+
+uint8_t hal_eeprom_read(uint16_t addr){
+	host_setup();
+	if(hal_eeprom_busy()){
+		eeprom.violations++;
+	}
+	return eeprom.data[addr % HAL_EEPROM_SIZE];
+}
+
+void hal_eeprom_write(uint16_t addr, uint8_t data){
+	host_setup();
+	addr %= HAL_EEPROM_SIZE;
+	if(hal_eeprom_busy()){
+		eeprom.violations++;
+	}
+	eeprom.data[addr] = data;
+	eeprom.busyUntil = hostNs + HAL_EEPROM_WRITE_US * 1000ULL;
+	eeprom.writes++;
+	hostIdleNs = hostNs;
+	if(eeprom.fd >= 0 && pwrite(eeprom.fd, &data, 1, addr) != 1){
+		perror("lcd_host: LCD_HOST_EEPROM");
+	}
+}
+
+uint8_t hal_reset_power_on(void){
+	host_setup();
+	return !hostWarm;
+}
+
+//  Benchmarks are counted in cycles under a simulator - nothing to do here  //
+void hal_bench_mark(uint8_t op){
+	(void)op;
+}
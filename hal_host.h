@@ -0,0 +1,95 @@
+/*
+ * hal_host.h - Linux backend for hal.h
+ * Description:	Declarations for the host build of the firmware. The
+ *		functions are implemented in hal_host.c, which emulates the
+ *		KS0066U LCD controller on the LCD bus pins and serves the USARTs
+ *		on ptys. The avr-libc pieces main.c relies on (ISR, sei,
+ *		stdio streams) are mapped onto the emulator here.
+ */
+
+#ifndef HAL_HOST_H_
+#define HAL_HOST_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+//  Interrupt handlers become plain functions called by the emulator  //
+#define ISR(vector) void hal_isr_##vector(void)
+#define sei() hal_irq_enable()
+#define cli() hal_irq_disable()
+
+//  USART status bits returned by hal_uart_status  //
+#define HAL_UART_DATA_OVERRUN (1 << 3)
+#define HAL_UART_FRAME_ERROR  (1 << 4)
+
+//  Flash strings - program memory is ordinary memory on the host  //
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t*)(addr))
+#define memcpy_P memcpy
+#define strcmp_P strcmp
+#define strchr_P strchr
+#define fputs_P fputs
+#define fprintf_P fprintf
+
+//  avr-libc stream flags  //
+#define _FDEV_SETUP_READ  0x01
+#define _FDEV_SETUP_WRITE 0x02
+#define _FDEV_SETUP_RW    0x03
+
+//  Stdio stream bound to a put/get function pair - opened before main runs  //
+#define HAL_STREAM(name, put, get, flags) \
+	static FILE* name; \
+	static void __attribute__((constructor)) name##_open(void){ \
+		name = hal_host_stream(put, get); \
+	} \
+	static FILE* name
+
+FILE* hal_host_stream(int (*put)(char, FILE*), int (*get)(FILE*));
+
+void hal_irq_enable(void);
+void hal_irq_disable(void);
+void hal_wait(void);
+void hal_delay_us(uint32_t us);
+void hal_delay_ms(uint32_t ms);
+void hal_sleep_init(void);
+void hal_sleep_idle(void);
+
+void hal_gpio_init(void);
+void hal_lcd_data(uint8_t Data);
+void hal_lcd_rs(uint8_t high);
+void hal_lcd_e(uint8_t panel, uint8_t high);
+void hal_lcd_e_pulse(uint8_t panel);
+void hal_lcd_rw(uint8_t high);
+void hal_lcd_data_dir(uint8_t output);
+uint8_t hal_lcd_busy_flag(void);
+void hal_heartbeat_toggle(void);
+
+void hal_timer0_init(uint8_t top);
+uint8_t hal_timer0_count(void);
+uint8_t hal_timer0_pending(void);
+void hal_lcd_timer_init(uint8_t top);
+void hal_lcd_timer_start(void);
+void hal_lcd_timer_irq(uint8_t on);
+uint8_t hal_lcd_timer_irq_enabled(void);
+void hal_backlight_init(void);
+void hal_backlight_set(uint8_t level);
+
+void hal_uart_init(uint8_t port, uint16_t ubrr, uint8_t u2x);
+uint8_t hal_uart_status(uint8_t port);
+uint8_t hal_uart_read(uint8_t port);
+void hal_uart_write(uint8_t port, uint8_t c);
+void hal_uart_tx_irq(uint8_t port, uint8_t on);
+void hal_uart_flow_init(void);
+void hal_uart_rts(uint8_t ready);
+uint8_t hal_uart_cts(void);
+
+uint8_t hal_eeprom_busy(void);
+uint8_t hal_eeprom_read(uint16_t addr);
+void hal_eeprom_write(uint16_t addr, uint8_t data);
+uint8_t hal_reset_power_on(void);
+
+void hal_bench_mark(uint8_t op);
+
+#endif /* HAL_HOST_H_ */
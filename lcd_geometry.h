@@ -0,0 +1,83 @@
+/*
+ * lcd_geometry.h - character LCD size and panel count
+ * Description:	Compile time geometry of the character LCDs. Select a panel
+ *		with LCD_GEOMETRY, e.g. make CONFIG=-DLCD_GEOMETRY=LCD_GEOMETRY_20X4
+ *		(16x2 is the default). The frame buffer, line wrapping, the
+ *		line length check and DDRAM addressing are all built from the
+ *		constants below, so the compiler folds them and a larger panel
+ *		costs no extra run time.
+ *
+ *		KS0066U/HD44780 DDRAM layout: the controller always runs in
+ *		two line mode, with line one at 0x00 and line two at 0x40.
+ *		Four row panels split each line in half, so rows 2 and 3
+ *		start LCD_COLS after rows 0 and 1 (0x14 and 0x54 on a 20x4).
+ *
+ *		LCD_PANELS (1-4) panels of this size can share the D4-D7, RS
+ *		and RW lines. Each one has its own E line: panel 0 on PB1,
+ *		panels 1-3 on PC0-PC2.
+ *
+ *		LCD_BUS_8BIT set to 1 runs the panels on a full 8-bit bus,
+ *		with D0-D3 on PA0-PA3 as well. Each write is then one E
+ *		pulse instead of two.
+ */
+
+#ifndef LCD_GEOMETRY_H_
+#define LCD_GEOMETRY_H_
+
+#define LCD_GEOMETRY_16X2 0
+#define LCD_GEOMETRY_20X4 1
+#define LCD_GEOMETRY_40X2 2
+
+#ifndef LCD_GEOMETRY
+#define LCD_GEOMETRY LCD_GEOMETRY_16X2
+#endif
+
+#if LCD_GEOMETRY == LCD_GEOMETRY_16X2
+#define LCD_ROWS 2
+#define LCD_COLS 16
+#elif LCD_GEOMETRY == LCD_GEOMETRY_20X4
+#define LCD_ROWS 4
+#define LCD_COLS 20
+#elif LCD_GEOMETRY == LCD_GEOMETRY_40X2
+#define LCD_ROWS 2
+#define LCD_COLS 40
+#else
+#error "unknown LCD_GEOMETRY"
+#endif
+
+#define LCD_CELLS (LCD_ROWS * LCD_COLS)
+
+#ifndef LCD_PANELS
+#define LCD_PANELS 1
+#endif
+#if LCD_PANELS < 1 || LCD_PANELS > 4
+#error "LCD_PANELS must be 1 to 4 - only PB1 and PC0-PC2 are wired as E lines"
+#endif
+
+#ifndef LCD_BUS_8BIT
+#define LCD_BUS_8BIT 0
+#endif
+
+//  For two line mode  //
+#define LineOneStart 0x00
+#define LineTwoStart 0x40 //  must set DDRAM address in LCD controller for line two  //
+
+//  DDRAM address of the first cell of a row  //
+#define LCD_ROW_START(row) ((((row) & 1) ? LineTwoStart : LineOneStart) + ((row) >> 1) * LCD_COLS)
+
+//  DDRAM cells behind a row - on two row panels each row has a whole 40 cell
+//  line, and the cells past LCD_COLS come into view when the display shifts  //
+#if LCD_ROWS == 2
+#define LCD_ROW_CELLS 40
+#else
+#define LCD_ROW_CELLS LCD_COLS
+#endif
+
+//  Row after row, wrapping from the last row back to the first  //
+#define LCD_NEXT_ROW(row) ((row) + 1 == LCD_ROWS ? 0 : (row) + 1)
+
+#if LCD_COLS * ((LCD_ROWS + 1) / 2) > 40
+#error "LCD geometry does not fit the 40 cells of a DDRAM line"
+#endif
+
+#endif /* LCD_GEOMETRY_H_ */
@@ -42,93 +42,677 @@
  * |	   5V|----5V---|VDD	|	|      GND|--GND
  * |	  GND|---GND---|VSS	|	-----------
  * -----------	       ----------
+ *
+ * With LCD_USE_BUSY_FLAG set to 1, RW is wired to B2 (pin 51) instead of GND
+ * so the busy flag can be read back on D7.
+ *
+ * With LCD_BUS_8BIT set to 1, D0-D3 are wired as well: D0 on A0 (pin 22) up
+ * to D3 on A3 (pin 25).
+ *
+ * With LCD_PANELS above 1, extra panels are wired in parallel with the first
+ * (D4-D7, RS, RW) except for E: panel 1 on C0 (pin 37), panel 2 on C1 
+ * (pin 36) and panel 3 on C2 (pin 35).
+ *
+ * The backlight can be dimmed with Ctrl+B: drive the LCD A pin from H3 (pin 6,
+ * OC4A) through a transistor instead of tying it to 5V.
+ *
+ * With UART_PORTS above 1, USART1-3 take input as well: USART1 on D2/D3
+ * (RXD1 pin 19, TXD1 pin 18), USART2 on H0/H1 (RXD2 pin 17, TXD2 pin 16) and
+ * USART3 on J0/J1 (RXD3 pin 15, TXD3 pin 14).
+ *
+ * With UART_FLOW set to UART_FLOW_RTSCTS, USART0 has handshake lines: RTS out
+ * on E4 (pin 2) to the host's CTS, and CTS in on E5 (pin 3) from the host's 
+ * RTS.
  */
 
 #define F_CPU 16000000
 
+//  LCD timing - 0 uses fixed worst-case waits, 1 polls the busy flag (RW on PORTB)  //
+#ifndef LCD_USE_BUSY_FLAG
+#define LCD_USE_BUSY_FLAG 0
+#endif
+
 #include <stdio.h>
-#include <avr/io.h>
-#include <util/delay.h>
-#include <avr/interrupt.h>
 #include <string.h>
+#include <stddef.h>	//offsetof, for the snapshot record CRC
+#include "hal.h"	//AVR registers, or the host emulator with HAL_HOST
+#include "lcd_geometry.h"	//LCD_ROWS, LCD_COLS and DDRAM row addresses
+
+//  Serial baud rate - set with make BAUD=115200 (or 250000, 500000, 1000000).
+//  The baud divider is picked at compile time: UBRR is rounded for both 
+//  normal (16 samples per bit) and double speed U2X (8 samples per bit) 
+//  mode, and the mode with the smaller error wins - normal mode on a tie, 
+//  as its receiver takes more samples. The build fails if the rate is 
+//  still off by more than UART_BAUD_TOL  //
+#ifndef USART_BAUDRATE
+#define USART_BAUDRATE 57600UL
+#endif
+#ifndef UART_BAUD_TOL
+#define UART_BAUD_TOL 25                           // baud error limit, tenths of a percent //
+#endif
+
+#define UART_UBRR_1X ((F_CPU + 8UL * USART_BAUDRATE) / (16UL * USART_BAUDRATE) - 1)
+#define UART_UBRR_2X ((F_CPU + 4UL * USART_BAUDRATE) / (8UL * USART_BAUDRATE) - 1)
+#define UART_RATE(div, ubrr) (F_CPU / ((div) * ((ubrr) + 1)))
+#define UART_ERROR(rate) (((rate) > USART_BAUDRATE ? (rate) - USART_BAUDRATE \
+			   : USART_BAUDRATE - (rate)) * 1000 / USART_BAUDRATE)
+#define UART_ERROR_1X UART_ERROR(UART_RATE(16UL, UART_UBRR_1X))
+#define UART_ERROR_2X UART_ERROR(UART_RATE(8UL, UART_UBRR_2X))
+
+#if F_CPU < 8UL * USART_BAUDRATE
+#error "USART_BAUDRATE is above F_CPU / 8, the fastest rate a USART can run"
+#elif UART_ERROR_2X < UART_ERROR_1X
+#define BAUD_PRESCALE UART_UBRR_2X
+#define BAUD_U2X 1
+#define BAUD_ERROR UART_ERROR_2X
+#else
+#define BAUD_PRESCALE UART_UBRR_1X
+#define BAUD_U2X 0
+#define BAUD_ERROR UART_ERROR_1X
+#endif
+#if defined(BAUD_PRESCALE) && BAUD_PRESCALE > 4095
+#error "USART_BAUDRATE is below the range of the 12-bit baud rate register"
+#elif defined(BAUD_ERROR) && BAUD_ERROR > UART_BAUD_TOL
+#error "USART_BAUDRATE cannot be made within UART_BAUD_TOL at this F_CPU"
+#endif
+
+//  Serial input ports - USART0 plus up to three more. Each port has its own
+//  ring buffers, line and prompt, and draws on its own panel (port n starts
+//  on panel n, @n moves it). Binary frames are only taken on USART0  //
+#ifndef UART_PORTS
+#define UART_PORTS 1
+#endif
+#if UART_PORTS < 1 || UART_PORTS > 4
+#error "UART_PORTS must be 1 to 4 - the ATMega 2560 has USART0-3"
+#endif
+
+//  Terminal mode - Ctrl+T at the prompt turns it on and off. Every line goes
+//  into a history ring and the LCD shows a window on the newest lines, Ctrl+U
+//  and Ctrl+D page the window up and down. Lines wider than the LCD scroll 
+//  sideways: two row panels shift the display (DDRAM holds the whole line), 
+//  four row panels redraw the row  //
+#ifndef TERM_LINES
+#define TERM_LINES 96                              // history ring - 96 x 41 bytes of SRAM //
+#endif
+#if TERM_LINES < LCD_ROWS || TERM_LINES > 255
+#error "TERM_LINES must be LCD_ROWS to 255 - the history is indexed with 8 bits"
+#endif
+#define TERM_LINE_LEN 40                           // one DDRAM line, longer messages take more lines //
+#define TERM_SCROLL_MS 350                         // sideways scroll step //
+#define TERM_SCROLL_HOLD 4                         // steps to stay at each end //
+#define TERM_HW_SHIFT (LCD_ROW_CELLS > LCD_COLS)   // scroll with the display shift instruction //
+#if TERM_LINE_LEN > LCD_ROW_CELLS && TERM_HW_SHIFT
+#error "TERM_LINE_LEN must fit the DDRAM line of a row to scroll it with the display shift"
+#endif
+
+#if LCD_CELLS + 8 > 2 * TERM_LINE_LEN + 1
+#define MAX_INPUT (LCD_CELLS + 8)                  // room to tell a line that is too long //
+#else
+#define MAX_INPUT (2 * TERM_LINE_LEN + 1)          // terminal messages of two history lines //
+#endif
+#define INPUT_TRUNCATED -1                         // getInput status, line longer than MAX_INPUT - 1 //
+#define INPUT_PENDING -2                           // getInput status, line not finished yet //
+#define PANEL_NONE -1                              // checkPanelSelect, line has no @n prefix //
+#define PANEL_BAD  -2                              // checkPanelSelect, no such panel //
+
+//  Commands - a line that starts with a control char is looked up in the 
+//  command table by that char, so finding any command is one table read. 
+//  Numbers after the char are its arguments, e.g. Ctrl+B 128 or Ctrl+P 1 4.
+//  A line with an ESC in it is drawn at the cursor instead of on a cleared
+//  row, and the VT100 sequences in it move the cursor and erase  //
+#define CMD_TEXT 0                                 // command_dispatch, line is text //
+#define CMD_DONE 1                                 // command ran, nothing to draw //
+#define CMD_DRAW 2                                 // command changed the frame buffer or cursor //
+#define CMD_CHARS 0x20                             // table covers the control chars //
+#define CMD_MAX_ARGS 2
+#define VT_ESC 0x1B
+#define VT_MAX_PARAMS 2
+#define VT_SHOW_COL(col) ((col) < LCD_COLS ? (col) : LCD_COLS - 1)  // a pending wrap shows on the last column //
+#define BACKLIGHT_DEFAULT 255                      // full brightness at power up //
+
+//  Scheduler task bits - set in tasksPending by interrupts, run by main  //
+#define TASK_UART      (1 << 0)                    // received bytes to parse //
+#define TASK_LCD_FLUSH (1 << 1)                    // frame buffer changed //
+#define TASK_HEARTBEAT (1 << 2)                    // heartbeat pin is due //
+#define TASK_FRAME_TIMEOUT (1 << 3)                // partial frame went quiet //
+#define TASK_TERM_SCROLL (1 << 4)                  // terminal scroll step is due //
+#define TASK_SNAPSHOT  (1 << 5)                    // display state is due to be saved //
+
+//  System tick - Timer0 CTC at 1 kHz drives millis() and the soft timers  //
+#define SYS_TICK_HZ 1000
+#define SYS_TICK_PRESCALE 64                       // set by hal_timer0_init //
+#define SYS_TICK_TOP (F_CPU / SYS_TICK_PRESCALE / SYS_TICK_HZ - 1)
+#if SYS_TICK_TOP > 255 || (F_CPU % (SYS_TICK_PRESCALE * SYS_TICK_HZ)) != 0
+#error "SYS_TICK_HZ needs an exact 8-bit Timer0 compare value at this F_CPU"
+#endif
 
-#define USART_BAUDRATE 57600
-#define BAUD_PRESCALE F_CPU / (USART_BAUDRATE * 16UL) - 1
+//  Run time statistics, dumped with Ctrl+R. Latencies are timed with micros()
+//  (Timer0 count, 4 us steps) and kept as min/avg/max and a histogram. 
+//  Bucket 0 holds samples under 16 us, and each bucket after it covers twice
+//  the span of the one before, up to the last which holds the rest  //
+#define STAT_BUCKETS 12
+#define STAT_SHIFT 4                               // bucket 0 is 0 to 2^STAT_SHIFT - 1 us //
+#define STAT_LINE_IDLE   0                         // statLineState - no line being timed //
+#define STAT_LINE_SEEN   1                         // line ended, not flushed yet //
+#define STAT_LINE_QUEUED 2                         // flushed, waiting for the LCD queue //
 
-#define MAX_INPUT 40
+//  Soft timers - count down on the system tick and post their task when done  //
+#define SOFT_TIMER_HEARTBEAT 0
+#define SOFT_TIMER_FRAME     1
+#define SOFT_TIMER_SCROLL    2
+#define SOFT_TIMER_SNAPSHOT  3
+#define SOFT_TIMERS          4
+#define HEARTBEAT_MS 500
+#define FRAME_TIMEOUT_MS 50                        // gap that drops a partial frame //
+
+//  Display snapshots - the frame buffers, text cursors, glyphs and settings
+//  are saved to EEPROM SNAPSHOT_DELAY_MS after input first changes them, so 
+//  a burst of lines costs one record. Records go round a ring of slots that
+//  fills the EEPROM, which spreads the wear, and only bytes that differ 
+//  from the slot's old record are written. At start up the newest record 
+//  with a good CRC is drawn before the prompt goes out  //
+#ifndef SNAPSHOT
+#ifdef BENCHMARK
+#define SNAPSHOT 0                                 // bench runs start from a blank screen //
+#else
+#define SNAPSHOT 1
+#endif
+#endif
+#ifndef SNAPSHOT_DELAY_MS
+#define SNAPSHOT_DELAY_MS 5000
+#endif
+#if SNAPSHOT_DELAY_MS < 1 || SNAPSHOT_DELAY_MS > 65535
+#error "SNAPSHOT_DELAY_MS must fit a soft timer, 1 to 65535"
+#endif
+#define SNAP_LAYOUT (0x40 | (LCD_GEOMETRY << 4) | ((LCD_PANELS - 1) << 2) | (UART_PORTS - 1))
+#define SNAP_SLOTS (HAL_EEPROM_SIZE / sizeof(struct snap_record))
+#define SNAP_NONE 0xFF                             // snapSlot, no record found or written //
+#define SNAP_COMPARES 8                            // EEPROM bytes checked per system tick //
+
+//  Binary frame protocol - opt-in alongside the text prompt. Sending FRAME_SOF
+//  at the prompt switches to frame mode until a FRAME_OP_TEXT frame. A frame 
+//  is SOF, LEN, SEQ, OP, LEN payload bytes and a CRC-16/CCITT (init 0xFFFF,
+//  high byte first) over LEN to the end of the payload. Every frame is 
+//  answered with an ACK or NAK frame carrying the same SEQ. With XON/XOFF
+//  flow control a SEQ or CRC byte of a reply can be 0x11 or 0x13 and stop
+//  the host, so frame mode is left out and FRAME_SOF is a plain text byte  //
+#define FRAME_ENABLED (UART_FLOW != UART_FLOW_XONXOFF)
+#define FRAME_SOF 0xA5
+#define FRAME_MAX_PAYLOAD 64
+#define FRAME_OP_WRITE_AT   0x01                   // row, col, chars - clipped at the end of the row //
+#define FRAME_OP_CLEAR      0x02                   // no payload //
+#define FRAME_OP_SET_CURSOR 0x03                   // row, col used by FRAME_OP_WRITE //
+#define FRAME_OP_WRITE      0x04                   // chars at the cursor, wraps to the next row //
+#define FRAME_OP_BATCH      0x05                   // records of row, col, count, chars //
+#define FRAME_OP_TEXT       0x06                   // back to the text prompt //
+#define FRAME_OP_PANEL      0x07                   // panel, selects the panel later frames draw on //
+#define FRAME_OP_GLYPH      0x08                   // id, 8 rows of 5 dots - defines a user glyph //
+#define FRAME_OP_GLYPH_AT   0x09                   // row, col, id - shows a glyph //
+#define FRAME_OP_BAR        0x0A                   // row, col, width, value, max - bar graph //
+#define FRAME_OP_SPARK      0x0B                   // row, col, max, values - sparkline, one cell each //
+#define FRAME_OP_ACK        0x80                   // reply, no payload //
+#define FRAME_OP_NAK        0x81                   // reply, payload is one FRAME_ERR_* code //
+#define FRAME_ERR_CRC  1
+#define FRAME_ERR_LEN  2
+#define FRAME_ERR_OP   3
+#define FRAME_ERR_ARGS 4
+
+//  frame_receive states - the field the next byte belongs to  //
+#define FRAME_RX_SOF     0
+#define FRAME_RX_LEN     1
+#define FRAME_RX_SEQ     2
+#define FRAME_RX_OP      3
+#define FRAME_RX_PAYLOAD 4
+#define FRAME_RX_CRC_HI  5
+#define FRAME_RX_CRC_LO  6
+
+//  Benchmark build (make bench) - BENCH_MARK writes an operation id to GPIOR0 
+//  at the start of an operation and BENCH_OP_NONE at the end, so the 
+//  simulator harness in bench/ can count the cycles in between. The ids must
+//  match the names in bench/bench_simavr.c  //
+#ifdef BENCHMARK
+#define BENCH_MARK(op) hal_bench_mark(op)
+#else
+#define BENCH_MARK(op)
+#endif
+#define BENCH_OP_NONE        0
+#define BENCH_OP_WRITE_STR   1                     // LCD_write_str, one line //
+#define BENCH_OP_WRITE_WRAP  2                     // LCD_write_str, wrapped over two lines //
+#define BENCH_OP_CLEAR_LINE  3                     // LCD_clear_line //
+#define BENCH_OP_CHECK_LEN   4                     // checkInputLen, 31 chars //
+#define BENCH_OP_FLUSH       5                     // LCD_flush, both lines changed //
+#define BENCH_OP_LCD_DRAIN   6                     // flushed cells until LCD queue is idle //
+#define BENCH_OP_OUTPUT_LINE 7                     // outputLine in the main loop //
+#define BENCH_OP_LOOP_FLUSH  8                     // LCD_flush in the main loop //
+#define BENCH_OP_LCD_BYTE    9                     // one byte on the LCD bus, both nybbles //
+#define BENCH_REPEAT 16
+
+//  CGRAM glyph cache - glyph ids are mapped onto the 8 CGRAM slots of each
+//  panel and a miss reloads the least recently used slot. DDRAM codes 0x08-
+//  0x0F show CGRAM 0-7 like 0x00-0x07 do, and are used so a glyph is never
+//  a string terminator  //
+#define GLYPH_SLOTS 8
+#define GLYPH_IDS 32                               // ids 0 to GLYPH_IDS - 1 //
+#define GLYPH_NONE 0xFF                            // id not loaded, or slot empty //
+#define GLYPH_CHAR(slot) (0x08 + (slot))           // DDRAM code that shows a slot //
+#define GLYPH_BAR_FIRST 0                          // ids 0-3, bar cells 1-4 dots wide //
+#define GLYPH_SPARK_FIRST 4                        // ids 4-10, sparkline cells 1-7 dots high //
+#define GLYPH_USER_FIRST 16                        // ids 16-31, defined with FRAME_OP_GLYPH //
+#define GLYPH_USER_IDS (GLYPH_IDS - GLYPH_USER_FIRST)
+#define LCD_CHAR_BLOCK 0xFF                        // all dots on, from the character ROM //
+
+//  USART ring buffer sizes, per port - must be powers of two (max 256)  //
+#ifndef UART_RX_BUFFER_SIZE
+#define UART_RX_BUFFER_SIZE 64
+#endif
+#ifndef UART_TX_BUFFER_SIZE
+#define UART_TX_BUFFER_SIZE 64
+#endif
+#define UART_RX_BUFFER_MASK (UART_RX_BUFFER_SIZE - 1)
+#define UART_TX_BUFFER_MASK (UART_TX_BUFFER_SIZE - 1)
+
+#if (UART_RX_BUFFER_SIZE & UART_RX_BUFFER_MASK) || (UART_RX_BUFFER_SIZE > 256)
+#error "UART_RX_BUFFER_SIZE must be a power of two no larger than 256"
+#endif
+#if (UART_TX_BUFFER_SIZE & UART_TX_BUFFER_MASK) || (UART_TX_BUFFER_SIZE > 256)
+#error "UART_TX_BUFFER_SIZE must be a power of two no larger than 256"
+#endif
+
+//  USART0 flow control watermarks (UART_FLOW, see hal.h) - the host is told
+//  to stop once UART_RX_STOP_AT bytes are waiting, and to go on once they 
+//  are down to UART_RX_GO_AT. The bytes above the stop mark are room for 
+//  what the host sends before it reacts  //
+#ifndef UART_RX_STOP_AT
+#define UART_RX_STOP_AT (UART_RX_BUFFER_SIZE - 16)
+#endif
+#ifndef UART_RX_GO_AT
+#define UART_RX_GO_AT (UART_RX_BUFFER_SIZE / 4)
+#endif
+#if UART_RX_STOP_AT >= UART_RX_BUFFER_SIZE || UART_RX_GO_AT >= UART_RX_STOP_AT
+#error "need UART_RX_GO_AT < UART_RX_STOP_AT < UART_RX_BUFFER_SIZE"
+#endif
 
 //  Helpful LCD control defines  //
 #define LCD_Reset              0b00110000          // reset the LCD to put in 4-bit mode //
 #define LCD_4bit_enable        0b00100000          // 4-bit data - can't set the line display or fonts until this is set  //
 #define LCD_4bit_mode          0b00101000          // 2-line display, 5 x 8 font  //
+#define LCD_8bit_mode          0b00111000          // 8-bit data, 2-line display, 5 x 8 font  //
 #define LCD_4bit_displayOFF    0b00001000          // set display off  //
 #define LCD_4bit_displayON     0b00001100          // set display on - no blink //
 #define LCD_4bit_displayON_Bl  0b00001101          // set display on - with blink //
 #define LCD_4bit_displayCLEAR  0b00000001          // replace all chars with "space"  //
+#define LCD_4bit_returnHOME    0b00000010          // cursor to 0x00 and undo any display shift  //
 #define LCD_4bit_entryMODE     0b00000110          // set curser to write/read from left -> right  //
 #define LCD_4bit_cursorSET     0b10000000          // set cursor position
+#define LCD_4bit_cgramSET      0b01000000          // set CGRAM address - slot * 8 + glyph row  //
+#define LCD_4bit_shiftLEFT     0b00011000          // move the display window right along DDRAM  //
+#define LCD_DISPLAY_ON         0b00000100          // display control bits, ORed into LCD_4bit_displayOFF  //
+#define LCD_CURSOR_ON          0b00000010          // underline cursor  //
+#define LCD_BLINK_ON           0b00000001          // blinking block cursor  //
 
 
-//  For two line mode  //
-#define LineOneStart 0x00
-#define LineTwoStart 0x40 //  must set DDRAM address in LCD controller for line two  //
+//  LCD command queue - filled by LCD_write_* and sent by the Timer2 interrupt  //
+#define LCD_QUEUE_SIZE 64                          // must be a power of two (max 256) //
+#define LCD_QUEUE_MASK (LCD_QUEUE_SIZE - 1)
+#if LCD_USE_BUSY_FLAG
+#define LCD_TICK_US 20                             // queue tick - busy flag poll interval //
+#else
+#define LCD_TICK_US 50                             // queue tick - must be > 43us //
+#endif
+#define LCD_TICK_CYCLES (F_CPU / 8 / 1000000UL * LCD_TICK_US)
+#define LCD_EXEC_TICKS ((43 + LCD_TICK_US - 1) / LCD_TICK_US)      // instruction > 43us //
+#define LCD_CLEAR_TICKS ((1530 + LCD_TICK_US - 1) / LCD_TICK_US)  // clear/home > 1.53ms //
+
+#if (LCD_QUEUE_SIZE & LCD_QUEUE_MASK) || (LCD_QUEUE_SIZE > 256)
+#error "LCD_QUEUE_SIZE must be a power of two no larger than 256"
+#endif
+#if (LCD_TICK_CYCLES > 256)
+#error "LCD_TICK_US is too long for timer2 with an 8 prescaler"
+#endif
+
+//  LCD queue entry types  //
+#define LCD_Q_INSTR   0x00                         // instruction, RS low //
+#define LCD_Q_DATA    0x01                         // character, RS high //
+#define LCD_Q_NIBBLE  0x02                         // single upper nybble (8-bit mode reset) //
+#define LCD_Q_DELAY   0x04                         // no write, wait data ms //
+#define LCD_Q_STREAM  0x08                         // chars of row data from its stream buffer //
+
+//  LCD_flush streams a row when this many cells or more in a row changed  //
+#define LCD_STREAM_MIN 4
+
+//  A clear display instruction costs about this many char writes (1.53 ms
+//  against 43 us) - LCD_flush uses it when blanking the old text costs more  //
+#define LCD_CLEAR_COST ((1530 + 42) / 43)
+
+#define LCD_CURSOR_NONE 0xFF                       // lcdCursorAddr after a CGRAM write //
+
 
-//  Pin definitions for PORTB control lines  //
-#define LCD_EnablePin 1
-#define LCD_RegisterSelectPin 0
 
 //prototypes for functions provided by Dr. Randy Hoover
-void LCD_init(void);
+void LCD_init(uint8_t);
 void LCD_E_RS_init(void);
-void LCD_write_4bits(uint8_t);
-void LCD_EnablePulse(void);
-void LCD_write_instruction(uint8_t);
-void LCD_write_char(char);
+void LCD_write_4bits(uint8_t, uint8_t);
+void LCD_write_8bits(uint8_t, uint8_t);
+void LCD_write_bus(uint8_t, uint8_t, uint8_t);
+void LCD_EnablePulse(uint8_t);
+void LCD_write_instruction(uint8_t, uint8_t);
+void LCD_write_char(uint8_t, char);
+
+// LCD command queue prototypes //
+void LCD_queue_push(uint8_t panel, uint8_t data, uint8_t ctrl);
+uint8_t LCD_queue_idle(void);
+void LCD_timer_init(void);
+#if LCD_USE_BUSY_FLAG
+uint8_t LCD_read_busy(uint8_t panel);
+#endif
 
 // Timer 0 initialization prototypes //
 void initializeTimers();
+uint32_t millis(void);
+void soft_timer_start(uint8_t id, uint16_t ms, uint16_t period);
+void soft_timer_stop(uint8_t id);
 
-// USART0 initialization prototypes //
-void InitUSART0();
+// USART initialization prototypes //
+void InitUSART(uint8_t port);
+FILE* uart_stream(uint8_t port);
+void uart_putchar(uint8_t port, char c);
 int uart_putchar0(char c, FILE* stream);
-int uart_getchar0(void);
+int uart_putchar1(char c, FILE* stream);
+int uart_putchar2(char c, FILE* stream);
+int uart_putchar3(char c, FILE* stream);
+uint8_t uart_available(uint8_t port);
+void uart_write(uint8_t port, uint8_t c);
+uint8_t uart_read(uint8_t port);
+uint8_t uart_peek(uint8_t port);
 
 //Prototypes for functions provided by Jace Johnson
 void LCD_write_str(char arr[MAX_INPUT], int* LCDLine);
+void LCD_write_str_P(const char* arr, int* LCDLine);
 void LCD_clear_line(int* line);
-int getInput0(char input[MAX_INPUT]);
-int checkInput(char input[MAX_INPUT]);
-int checkClearInput(char input[MAX_INPUT]);
+void LCD_clear_frame(uint8_t panel);
+void LCD_flush(void);
+uint8_t LCD_clear_cheaper(uint8_t panel);
+
+// CGRAM glyph cache and widget prototypes //
+void glyph_init(void);
+void glyph_define(uint8_t id, const uint8_t rows[8]);
+uint8_t glyph_use(uint8_t panel, uint8_t id);
+void glyph_upload(uint8_t panel, uint8_t slot, uint8_t id);
+void widget_bar(uint8_t row, uint8_t col, uint8_t width, uint8_t value, uint8_t max);
+void widget_sparkline(uint8_t row, uint8_t col, uint8_t* values, uint8_t count, uint8_t max);
+int getInput(uint8_t port, char input[MAX_INPUT]);
 int checkInputLen(char input[MAX_INPUT]);
 void outputLine(char input[MAX_INPUT], int* LCDLine, int returnStatus);
 void printErr(int* LCDLine);
 void outputHardLine(char input[MAX_INPUT]);
-void printHardErr();
 void outputHardChars(char char1, char char2);
+void runBenchmarks(void);
 
-static FILE USART0_OUT = FDEV_SETUP_STREAM(uart_putchar0, NULL, 
-	_FDEV_SETUP_WRITE);
-static FILE USART0_IN = FDEV_SETUP_STREAM(NULL, uart_getchar0, 
-	_FDEV_SETUP_READ);
+// Scheduler task prototypes //
+uint8_t task_uart(uint8_t port, char line[MAX_INPUT], int LCDLine[LCD_PANELS]);
+int checkPanelSelect(char input[MAX_INPUT]);
+
+// Run time statistics prototypes //
+struct stat_hist {
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint32_t sum;
+	uint16_t bucket[STAT_BUCKETS];
+};
+uint32_t micros(void);
+uint32_t micros_irqoff(void);
+void stat_add(struct stat_hist* stat, uint32_t us);
+void stat_print(const char* name, struct stat_hist* stat);
+
+// Command prototypes //
+struct command {
+	uint8_t (*run)(uint8_t argc, uint8_t argv[CMD_MAX_ARGS], int LCDLine[LCD_PANELS]);
+	uint8_t maxArgs;		//numbers the command takes
+};
+uint8_t command_dispatch(char input[MAX_INPUT], int LCDLine[LCD_PANELS]);
+uint8_t cmd_backlight(uint8_t argc, uint8_t argv[CMD_MAX_ARGS], int LCDLine[LCD_PANELS]);
+uint8_t cmd_clear(uint8_t argc, uint8_t argv[CMD_MAX_ARGS], int LCDLine[LCD_PANELS]);
+uint8_t cmd_page_down(uint8_t argc, uint8_t argv[CMD_MAX_ARGS], int LCDLine[LCD_PANELS]);
+uint8_t cmd_blink(uint8_t argc, uint8_t argv[CMD_MAX_ARGS], int LCDLine[LCD_PANELS]);
+uint8_t cmd_clear_line(uint8_t argc, uint8_t argv[CMD_MAX_ARGS], int LCDLine[LCD_PANELS]);
+uint8_t cmd_display(uint8_t argc, uint8_t argv[CMD_MAX_ARGS], int LCDLine[LCD_PANELS]);
+uint8_t cmd_position(uint8_t argc, uint8_t argv[CMD_MAX_ARGS], int LCDLine[LCD_PANELS]);
+uint8_t cmd_report(uint8_t argc, uint8_t argv[CMD_MAX_ARGS], int LCDLine[LCD_PANELS]);
+uint8_t cmd_terminal(uint8_t argc, uint8_t argv[CMD_MAX_ARGS], int LCDLine[LCD_PANELS]);
+uint8_t cmd_page_up(uint8_t argc, uint8_t argv[CMD_MAX_ARGS], int LCDLine[LCD_PANELS]);
+void lcd_display_ctrl(uint8_t bits, uint8_t on);
+void vt_write(char input[MAX_INPUT], int* LCDLine);
+int vt_escape(char input[MAX_INPUT], int i, int* row, int* col);
+void vt_erase(int row, int from, int to);
+
+// Terminal mode prototypes //
+void term_add(char input[MAX_INPUT], int returnStatus);
+char* term_line(uint8_t row);
+void term_draw(void);
+void term_render(void);
+void term_home(void);
+uint8_t term_scroll(void);
+
+// Binary frame protocol prototypes //
+uint16_t crc16_update(uint16_t crc, uint8_t data);
+uint8_t frame_receive(void);
+uint8_t frame_execute(uint8_t op, uint8_t* payload, uint8_t len);
+uint8_t frame_write_cells(uint8_t row, uint8_t col, uint8_t* chars, uint8_t count);
+void frame_send(uint8_t seq, uint8_t op, uint8_t* payload, uint8_t len);
+
+// Display snapshot prototypes //
+struct snap_record {
+	uint8_t layout;				//SNAP_LAYOUT of the build that wrote it
+	char frame[LCD_PANELS][LCD_ROWS][LCD_ROW_CELLS];
+	uint8_t line[LCD_PANELS];		//LCDLine
+	uint8_t textCol[LCD_PANELS];
+	uint8_t textAtCursor[LCD_PANELS];
+	uint8_t displayCtrl[LCD_PANELS];
+	uint8_t glyphSlotId[LCD_PANELS][GLYPH_SLOTS];
+	uint8_t glyphUser[GLYPH_USER_IDS][8];	//FRAME_OP_GLYPH dots
+	uint8_t uartPanel[UART_PORTS];
+	uint8_t lcdPanel;
+	uint8_t backlightLevel;
+	uint8_t backlightOn;
+	uint8_t seq[2];				//record number, high first - the newest wins
+	uint8_t crc[2];				//CRC-16/CCITT of everything above, high first
+};
+void snapshot_schedule(void);
+void snapshot_save(int LCDLine[LCD_PANELS]);
+uint8_t snapshot_restore(int LCDLine[LCD_PANELS]);
+uint8_t snapshot_in_range(void);
+void snapshot_write_step(void);
+
+//  USART ring buffers, one set per port - filled/drained by the RX and UDRE 
+//  interrupts  //
+static volatile uint8_t uartRxBuf[UART_PORTS][UART_RX_BUFFER_SIZE];
+static volatile uint8_t uartRxHead[UART_PORTS];	//next free slot, written by ISR
+static volatile uint8_t uartRxTail[UART_PORTS];	//next byte to read, written by main
+static volatile uint8_t uartTxBuf[UART_PORTS][UART_TX_BUFFER_SIZE];
+static volatile uint8_t uartTxHead[UART_PORTS];	//next free slot, written by main
+static volatile uint8_t uartTxTail[UART_PORTS];	//next byte to send, written by ISR
+static uint8_t uartSkipLf[UART_PORTS];		//last line ended in CR, drop a following LF
+static int inputLen[UART_PORTS];		//chars of the line read so far
+static uint8_t inputTruncated[UART_PORTS];	//line has run past MAX_INPUT - 1
+static uint8_t uartPanel[UART_PORTS];		//panel each port draws on
+static FILE* uartOut;				//replies go to the port being served
+static volatile uint8_t uartRxStopped = 0;	//USART0 host told to stop (UART_FLOW)
+static volatile uint8_t uartFlowByte = 0;	//XON or XOFF to send ahead of the ring
+
+//  Scheduler - interrupts set task bits, main runs them or sleeps  //
+static volatile uint8_t tasksPending = 0;
+
+//  System tick and soft timers - counted down by the Timer0 interrupt  //
+static volatile uint32_t sysMillis = 0;
+static volatile uint16_t softTimerLeft[SOFT_TIMERS];	//ticks to expiry, 0 = stopped
+static volatile uint16_t softTimerPeriod[SOFT_TIMERS];	//reload, 0 = one shot
+static const uint8_t softTimerTask[SOFT_TIMERS] = {TASK_HEARTBEAT, TASK_FRAME_TIMEOUT,
+						   TASK_TERM_SCROLL, TASK_SNAPSHOT};
+
+//  Binary frame protocol state  //
+static uint8_t frameMode = 0;			//1 while frames replace the prompt
+static uint8_t frameState = FRAME_RX_SOF;	//next field frame_receive expects
+static uint8_t frameLen, frameSeq, frameOp, frameIndex;
+static uint16_t frameCrc;
+static uint8_t frameRow = 0;			//FRAME_OP_WRITE cursor
+static uint8_t frameCol = 0;
+static uint8_t framePayload[FRAME_MAX_PAYLOAD];
+
+//  LCD command queues, one per panel - filled by main, drained by the Timer2 interrupt  //
+static volatile uint8_t lcdQueueData[LCD_PANELS][LCD_QUEUE_SIZE];
+static volatile uint8_t lcdQueueCtrl[LCD_PANELS][LCD_QUEUE_SIZE];
+static volatile uint8_t lcdQueueHead[LCD_PANELS];	//next free slot, written by main
+static volatile uint8_t lcdQueueTail[LCD_PANELS];	//next entry to send, written by ISR
+static volatile uint16_t lcdWaitTicks[LCD_PANELS];	//ticks left for the last entry
+static volatile uint8_t lcdDelayMs[LCD_PANELS];		//system ticks left in an LCD_Q_DELAY
+#if LCD_USE_BUSY_FLAG
+static volatile uint8_t lcdCheckBusy[LCD_PANELS];	//poll BF before the next entry
+#endif
+
+//  LCD row streams - LCD_flush copies a changed span of a row here and queues 
+//  one LCD_Q_STREAM entry, the Timer2 interrupt sends a char per tick  //
+static volatile char lcdStreamBuf[LCD_PANELS][LCD_ROWS][LCD_ROW_CELLS];
+static volatile uint8_t lcdStreamCol[LCD_PANELS][LCD_ROWS];	//next col to send
+static volatile uint8_t lcdStreamEnd[LCD_PANELS][LCD_ROWS];	//col after the span
+static volatile uint8_t lcdStreamBusy[LCD_PANELS];		//a stream is being sent
+
+//  LCD frame buffers - LCD_write_str draws here, LCD_flush sends the changes  //
+//  (rows are LCD_ROW_CELLS wide - the cells past LCD_COLS are only seen when the 
+//  terminal shifts the display)  //
+static char lcdFrame[LCD_PANELS][LCD_ROWS][LCD_ROW_CELLS];	//what should be in DDRAM
+static char lcdShadow[LCD_PANELS][LCD_ROWS][LCD_ROW_CELLS];	//what DDRAM holds now
+static uint8_t lcdCursorAddr[LCD_PANELS];		//DDRAM address of the cursor
+static uint8_t lcdPanel = 0;				//panel the text and frame
+							//commands draw on
+
+//  Text cursor and display control, per panel - the text cursor is where an
+//  escape sequence line or a line after Ctrl+P starts, its row is LCDLine  //
+static uint8_t textCol[LCD_PANELS];			//column of the text cursor
+static uint8_t textAtCursor[LCD_PANELS];		//Ctrl+P - next line goes to the cursor
+static uint8_t lcdDisplayCtrl[LCD_PANELS];		//display on/off control instruction
+static uint8_t lcdShowAddr[LCD_PANELS];			//DDRAM address the LCD cursor is 
+							//shown at (cursor or blink on)
+static uint8_t backlightLevel = BACKLIGHT_DEFAULT;	//Ctrl+B brightness, 0-255
+static uint8_t backlightOn = 1;
+
+//  Command table in flash, indexed by the control char that starts the line  //
+static const struct command commands[CMD_CHARS] PROGMEM = {
+	[0x02] = {cmd_backlight, 1},	//Ctrl+B [level] - toggle or set brightness
+	[0x03] = {cmd_clear, 0},	//Ctrl+C - clear the panel or the history
+	[0x04] = {cmd_page_down, 0},	//Ctrl+D - terminal page down
+	[0x05] = {cmd_blink, 0},	//Ctrl+E - blinking cursor on/off
+	[0x0B] = {cmd_clear_line, 1},	//Ctrl+K [row] - clear a row
+	[0x0C] = {cmd_clear, 0},	//Ctrl+L - same as Ctrl+C
+	[0x0F] = {cmd_display, 0},	//Ctrl+O - display on/off
+	[0x10] = {cmd_position, 2},	//Ctrl+P row [col] - move the text cursor
+	[0x12] = {cmd_report, 0},	//Ctrl+R - run time statistics
+	[0x14] = {cmd_terminal, 0},	//Ctrl+T - terminal mode on/off
+	[0x15] = {cmd_page_up, 0},	//Ctrl+U - terminal page up
+};
+
+//  Replies sent from more than one place - kept once, in flash  //
+static const char promptText[] PROGMEM = "Enter a string or command: ";
+static const char echoText[] PROGMEM = "Your str is: %s \n\r";
+
+//  CGRAM glyph cache - one set of slots per panel  //
+static uint8_t glyphBitmap[GLYPH_IDS][8];		//rows, bit 4 is the left dot
+static uint8_t glyphSlot[LCD_PANELS][GLYPH_IDS];	//slot holding each id
+static uint8_t glyphSlotId[LCD_PANELS][GLYPH_SLOTS];	//id held by each slot
+static uint8_t glyphLru[LCD_PANELS][GLYPH_SLOTS];	//slots, most recently used first
+
+//  Terminal mode state - the history ring and the window the LCD shows  //
+static uint8_t termMode = 0;			//1 while lines go to the history
+static char termHistory[TERM_LINES][TERM_LINE_LEN + 1];
+static uint8_t termNewest = TERM_LINES - 1;	//slot of the last line added
+static uint8_t termCount = 0;			//lines in the history
+static uint8_t termBack = 0;			//lines the window is above the newest
+static uint8_t termPanel = 0;			//panel the terminal draws on
+static uint8_t termScroll = 0;			//columns scrolled sideways
+static uint8_t termScrollMax = 0;		//columns to show the longest line
+static uint8_t termScrollHold = 0;		//steps left to wait at an end
+
+#if SNAPSHOT
+//  Display snapshot state - main stages a record in snapRecord, the system
+//  tick writes it to EEPROM slot snapSlot  //
+static struct snap_record snapRecord;
+static uint8_t snapSlot = SNAP_NONE;		//slot of the newest record
+static uint16_t snapSeq = 0;			//its record number
+static uint16_t snapStateCrc;			//its CRC up to seq - same state, no write
+static uint8_t snapArmed = 0;			//SOFT_TIMER_SNAPSHOT is running
+static volatile uint8_t snapWriting = 0;	//the tick is writing snapRecord
+static volatile uint16_t snapWriteAt;		//next byte of it to check
+#endif
+
+//  USART receive loss counters, per port - both stay at zero if no byte was 
+//  dropped  //
+volatile uint16_t uartRxOverflows[UART_PORTS];	//bytes dropped, ring buffer full
+volatile uint16_t uartRxOverruns[UART_PORTS];	//hardware data overruns (DORn)
+volatile uint16_t uartFlowStops = 0;		//times USART0's host was told to stop
+
+//  LCD stream rate - chars streamed and the queue ticks they took, see Ctrl+R  //
+volatile uint32_t lcdStreamChars = 0;
+volatile uint32_t lcdStreamTicks = 0;
+
+//  Run time statistics - counted where they happen, dumped with Ctrl+R  //
+volatile uint16_t uartRxFrameErrors[UART_PORTS];	//bytes with a bad stop bit (FEn)
+uint16_t statLinesIn = 0;			//lines received
+uint16_t statLinesLong = 0;			//lines rejected as too long
+volatile uint32_t statLcdWrites = 0;		//bytes and nibbles sent to the LCDs
+volatile uint16_t statLcdClears = 0;		//clear display instructions sent
+volatile uint16_t statSnapshots = 0;		//snapshot records written to EEPROM
+static struct stat_hist statLineLcd;		//line end to LCD queue empty
+static struct stat_hist statLoop;		//main loop pass, wake to sleep
+static uint32_t statLineStart;			//micros() at the line end
+static volatile uint8_t statLineState = STAT_LINE_IDLE;
+
+HAL_STREAM(USART0_OUT, uart_putchar0, NULL, _FDEV_SETUP_WRITE);
+#if UART_PORTS > 1
+HAL_STREAM(USART1_OUT, uart_putchar1, NULL, _FDEV_SETUP_WRITE);
+#endif
+#if UART_PORTS > 2
+HAL_STREAM(USART2_OUT, uart_putchar2, NULL, _FDEV_SETUP_WRITE);
+#endif
+#if UART_PORTS > 3
+HAL_STREAM(USART3_OUT, uart_putchar3, NULL, _FDEV_SETUP_WRITE);
+#endif
 
 int main(void)
 {
-	DDRB = 0x23;	//setup pins in ports A and B as outputs
-	DDRA = 0xF0;
+	hal_gpio_init();	//setup pins in ports A and B as outputs
 	
 	//Initialize the LCD for 4-bit mode, two lines, and 5 x 8 dots
 	//Inits found on Page 26 of datasheet and Table 7 for function set 
-	//instructions
-	LCD_init();
+	//instructions - the power up wait is only needed after power on
+	LCD_init(hal_reset_power_on());
+	glyph_init();		//CGRAM is random at power up, nothing is loaded
 	
 	//initialize timer 0 to toggle PORTB pin 0x20 for LCD screen
 	initializeTimers();	
-	//initialize USART 0 for transmit and recieve
-	InitUSART0();
+	hal_backlight_init();			//Timer4 PWM on OC4A
+	hal_backlight_set(BACKLIGHT_DEFAULT);
+	//initialize USART 0 (and 1-3) for transmit and recieve
+	for(uint8_t port = 0; port < UART_PORTS; port++){
+		uartPanel[port] = port % LCD_PANELS;
+		InitUSART(port);
+	}
+	uartOut = USART0_OUT;
     
-	int LCDLine = 0;
-	int retStat = 0;
-	char line[MAX_INPUT] = "this is fun";
+	int LCDLine[LCD_PANELS] = {0};	//next line on each panel
+	uint8_t pending;
+	uint32_t loopStart;
+	char lines[UART_PORTS][MAX_INPUT] = {"this is fun"};	//line from each port
+	
+#if SNAPSHOT
+	//bring back the last screen - it is drawn as soon as the LCDs are ready
+	if(snapshot_restore(LCDLine)){
+		LCD_flush();
+	}
+#endif
+	
+#ifdef BENCHMARK
+	runBenchmarks();	//time LCD and input checks before serial starts
+#endif
 	
 	//print single character on each line of LCD
 	/*
@@ -140,355 +724,2252 @@ int main(void)
 	
 	//print single line to LCD
 	/*
-	outputHardLine(line);	//output line
+	outputHardLine(lines[0]);	//output line
 	while(1){}   		//do nothing
 	*/
 	
-	//serial communication controlled LCD printing
+	//serial communication controlled LCD printing - interrupts post tasks,
+	//the CPU sleeps when there is nothing to do
+	hal_sleep_init();
+	soft_timer_start(SOFT_TIMER_HEARTBEAT, HEARTBEAT_MS, HEARTBEAT_MS);
+	for(uint8_t port = 0; port < UART_PORTS; port++){
+		fputs_P(promptText, uart_stream(port));
+	}
 	while(1)
 	{	
-		//prompt user
-		fprintf(&USART0_OUT, "Enter a string or command: ");
-		//get line from serial port
-		retStat = getInput0(line);
-		//check line and output to screen and serial port
-		outputLine(line, &LCDLine, retStat);
-		//delay half a second
-		_delay_ms(500);
+		cli();				//check and clear atomically so a
+		pending = tasksPending;		//post can't slip in before sleep
+		tasksPending = 0;
+		if(pending == 0){
+			hal_sleep_idle();	//enables interrupts, wakes on any
+			continue;
+		}
+		sei();
+		loopStart = micros();
+		
+		//a frame stopped part way - drop it and hunt for the next SOF
+		//(before parsing, so bytes that arrived since start fresh)
+		if(pending & TASK_FRAME_TIMEOUT){
+			frameState = FRAME_RX_SOF;
+		}
+		//parse received bytes as text lines or binary frames, 
+		//every port in turn
+		if(pending & TASK_UART){
+			for(uint8_t port = 0; port < UART_PORTS; port++){
+				if(task_uart(port, lines[port], LCDLine)){
+					pending |= TASK_LCD_FLUSH;
+				}
+			}
+		}
+#if SNAPSHOT
+		//input may have changed what is shown - save it a while later
+		if(pending & TASK_UART){
+			snapshot_schedule();
+		}
+		if(pending & TASK_SNAPSHOT){
+			snapshot_save(LCDLine);
+		}
+#endif
+		//move long terminal lines one column
+		if(pending & TASK_TERM_SCROLL){
+			if(term_scroll()){
+				pending |= TASK_LCD_FLUSH;
+			}
+		}
+		//send changed cells to the LCD
+		if(pending & TASK_LCD_FLUSH){
+			BENCH_MARK(BENCH_OP_LOOP_FLUSH);
+			LCD_flush();
+			BENCH_MARK(BENCH_OP_NONE);
+		}
+		//time the line to the LCD - now if it queued nothing, else
+		//the LCD tick takes the sample when the queue runs dry
+		if(statLineState == STAT_LINE_SEEN){
+			cli();
+			if(LCD_queue_idle()){
+				stat_add(&statLineLcd, micros_irqoff() - statLineStart);
+				statLineState = STAT_LINE_IDLE;
+			}
+			else{
+				statLineState = STAT_LINE_QUEUED;
+			}
+			sei();
+		}
+		if(pending & TASK_HEARTBEAT){
+			hal_heartbeat_toggle();
+		}
+		stat_add(&statLoop, micros() - loopStart);
 	}
 	return 1;
 }
 
 /*
- * ISR:  TIMER0_OVF_vect
- *  Interrupt for timer0 overflow. Toggles bit 6 of PORTB every 500 ms.
+ * ISR:  TIMER0_COMPA_vect
+ *  System tick, SYS_TICK_HZ. Advances millis(), counts down the soft timers
+ *  and posts the task of each one that runs out (the heartbeat is one of 
+ *  them). Also times LCD_Q_DELAY entries: the delay entry stays at the 
+ *  head of its panel's LCD queue until its ticks are up, then it is 
+ *  dropped and the LCD queue timer is started again if it had stopped.
+ *  A snapshot record being saved gets its next EEPROM byte here.
  *
  *  returns:	none
  */
-ISR(TIMER0_OVF_vect) {
-	PORTB ^= 0x20;	//toggle PORTB pin 6
-	//reset timer for 500 ms
-   	TCNT0 = (unsigned int)65536 - (unsigned int)(0.5 * 16000000.0 / 256.0); 
+ISR(TIMER0_COMPA_vect) {
+	sysMillis++;
+	for(uint8_t i = 0; i < SOFT_TIMERS; i++){
+		if(softTimerLeft[i] != 0 && --softTimerLeft[i] == 0){
+			tasksPending |= softTimerTask[i];
+			softTimerLeft[i] = softTimerPeriod[i];	//0 stops a one shot
+		}
+	}
+	for(uint8_t panel = 0; panel < LCD_PANELS; panel++){
+		if(lcdDelayMs[panel] != 0 && --lcdDelayMs[panel] == 0){	//LCD_Q_DELAY is over
+			lcdQueueTail[panel] = (lcdQueueTail[panel] + 1) & LCD_QUEUE_MASK;
+			if(!hal_lcd_timer_irq_enabled()){
+				hal_lcd_timer_start();
+			}
+		}
+	}
+#if SNAPSHOT
+	if(snapWriting && !hal_eeprom_busy()){
+		snapshot_write_step();
+	}
+#endif
+#if UART_FLOW == UART_FLOW_RTSCTS
+	//output held back by CTS goes on once the host takes bytes again
+	if(uartTxHead[0] != uartTxTail[0] && hal_uart_cts()){
+		hal_uart_tx_irq(0, 1);
+	}
+#endif
    	return;
 }
 
+#if UART_FLOW != UART_FLOW_NONE
+/*
+ * Function:	uart_flow
+ *  Tells the host on USART0 to stop or to go on sending, with an XOFF or 
+ *  XON that the UDRE interrupt sends ahead of any queued bytes, or with 
+ *  the RTS line. Must be called with interrupts disabled.
+ *
+ *  go		uint8_t	0 to stop the host, 1 to let it send again
+ *
+ *  returns:	none
+ */
+static inline void uart_flow(uint8_t go){
+	uartRxStopped = !go;
+#if UART_FLOW == UART_FLOW_XONXOFF
+	uartFlowByte = go ? UART_XON : UART_XOFF;	//a newer state replaces an unsent one
+	hal_uart_tx_irq(0, 1);
+#else
+	hal_uart_rts(go);
+#endif
+}
+#endif
+
+/*
+ * Function:	uart_rx_isr
+ *  Body of the USARTn receive complete interrupts. Moves the received byte
+ *  from UDRn into the port's receive ring buffer. If the ring buffer is full
+ *  the byte is dropped and counted in uartRxOverflows. Hardware overruns 
+ *  flagged by DORn are counted in uartRxOverruns.
+ *
+ *  port	uint8_t	USART number, a constant in each ISR
+ *
+ *  returns:	none
+ */
+static inline void uart_rx_isr(uint8_t port){
+	uint8_t status = hal_uart_status(port);	//status must be read before UDRn
+	uint8_t data = hal_uart_read(port);
+	uint8_t next = (uartRxHead[port] + 1) & UART_RX_BUFFER_MASK;
+	
+	if(status & HAL_UART_DATA_OVERRUN){	//a byte was lost before this one
+		uartRxOverruns[port]++;
+	}
+	if(status & HAL_UART_FRAME_ERROR){	//no stop bit, byte is kept
+		uartRxFrameErrors[port]++;
+	}
+	if(next == uartRxTail[port]){	//ring buffer full, drop byte
+		uartRxOverflows[port]++;
+		return;
+	}
+	uartRxBuf[port][uartRxHead[port]] = data;
+	uartRxHead[port] = next;
+	tasksPending |= TASK_UART;	//wake main to parse it
+#if UART_FLOW != UART_FLOW_NONE
+	if(port == 0 && !uartRxStopped
+	   && ((next - uartRxTail[0]) & UART_RX_BUFFER_MASK) >= UART_RX_STOP_AT){
+		uartFlowStops++;
+		uart_flow(0);
+	}
+#endif
+	return;
+}
+
+/*
+ * Function:	uart_udre_isr
+ *  Body of the USARTn data register empty interrupts. Sends the next byte 
+ *  from the port's transmit ring buffer, or disables the interrupt when the
+ *  buffer is empty. On USART0 a pending XON/XOFF goes first, and with 
+ *  RTS/CTS nothing is sent while the host holds CTS - the system tick 
+ *  starts the interrupt again.
+ *
+ *  port	uint8_t	USART number, a constant in each ISR
+ *
+ *  returns:	none
+ */
+static inline void uart_udre_isr(uint8_t port){
+#if UART_FLOW == UART_FLOW_XONXOFF
+	if(port == 0 && uartFlowByte != 0){
+		hal_uart_write(0, uartFlowByte);
+		uartFlowByte = 0;
+		return;
+	}
+#elif UART_FLOW == UART_FLOW_RTSCTS
+	if(port == 0 && !hal_uart_cts()){		//host cannot take more yet
+		hal_uart_tx_irq(0, 0);
+		return;
+	}
+#endif
+	if(uartTxHead[port] == uartTxTail[port]){	//nothing left to send
+		hal_uart_tx_irq(port, 0);
+		return;
+	}
+	hal_uart_write(port, uartTxBuf[port][uartTxTail[port]]);
+	uartTxTail[port] = (uartTxTail[port] + 1) & UART_TX_BUFFER_MASK;
+	return;
+}
+
+//  USART receive complete and data register empty interrupts  //
+ISR(USART0_RX_vect) {
+	uart_rx_isr(0);
+}
+
+ISR(USART0_UDRE_vect) {
+	uart_udre_isr(0);
+}
+
+#if UART_PORTS > 1
+ISR(USART1_RX_vect) {
+	uart_rx_isr(1);
+}
+
+ISR(USART1_UDRE_vect) {
+	uart_udre_isr(1);
+}
+#endif
+
+#if UART_PORTS > 2
+ISR(USART2_RX_vect) {
+	uart_rx_isr(2);
+}
+
+ISR(USART2_UDRE_vect) {
+	uart_udre_isr(2);
+}
+#endif
+
+#if UART_PORTS > 3
+ISR(USART3_RX_vect) {
+	uart_rx_isr(3);
+}
+
+ISR(USART3_UDRE_vect) {
+	uart_udre_isr(3);
+}
+#endif
+
 //  Important notes in sequence from page 26 in the KS0066U datasheet - initialize the LCD in 4-bit two line mode //
 //  LCD is initially set to 8-bit mode - we need to reset the LCD controller to 4-bit mode before we can set anyting else //
-void LCD_init(void)
+//  Every step is queued with the wait it needs - the Timer2 interrupt clocks them out, so this returns right away //
+//  Each panel gets its own copy of the sequence, so all panels initialize at the same time //
+//  After a reset button or watchdog reset the LCDs kept power and may be in 4-bit mode, part way //
+//  through a byte - the three resets bring them back to 8-bit mode from any state, without the power up wait //
+void LCD_init(uint8_t powerOn)
 {
-    //  Wait for power up - more than 30ms for vdd to rise to 4.5V //
-    _delay_ms(100);
+    //  Start the queue timer - nothing is sent until global interrupts are enabled  //
+    LCD_timer_init();
     
     //  Note that we need to reset the controller to enable 4-bit mode //
     LCD_E_RS_init();  //  Set the E and RS pins active low for each LCD reset  //
     
-    //  Reset and wait for activation  //
-    LCD_write_4bits(LCD_Reset);
-    _delay_ms(10);
-    
-    //  Now we can set the LCD to 4-bit mode  //
-    LCD_write_4bits(LCD_4bit_enable);
-    _delay_us(80);  //  delay must be > 39us  //
-    
-    
-    
-    ////////////////  system reset is complete - set up LCD modes  ////////////////////
-    //  At this point we are operating in 4-bit mode
-    //  (which means we have to send the high-nibble and low-nibble separate)
-    //  and can now set the line numbers and font size
-    //  Notice:  we use the "LCD_wirte_4bits() when in 8-bit mode and the LCD_instruction() (this just
-    //  makes use of two calls to the LCD_write_4bits() function )
-    //  once we're in 4-bit mode.  The set of instructions are found in Table 7 of the datasheet.  //
-    LCD_write_instruction(LCD_4bit_mode);
-    _delay_us(80);  //  delay must be > 39us  //
-    
-    //  From page 26 (and Table 7) in the datasheet we need to:
-    //  display = off, display = clear, and entry mode = set //
-    LCD_write_instruction(LCD_4bit_displayOFF);
-    _delay_us(80);  //  delay must be > 39us  //
-    
-    LCD_write_instruction(LCD_4bit_displayCLEAR);
-    _delay_ms(80);  //  delay must be > 1.53ms  //
-    
-    LCD_write_instruction(LCD_4bit_entryMODE);
-    _delay_us(80);  //  delay must be > 39us  //
-    
-    //  The LCD should now be initialized to operate in 4-bit mode, 2 lines, 5 x 8 dot fonstsize  //
-    //  Need to turn the display back on for use  //
-    LCD_write_instruction(LCD_4bit_displayON);
-    _delay_us(80);  //  delay must be > 39us  //
-
+    for(uint8_t panel = 0; panel < LCD_PANELS; panel++)
+    {
+        //  Wait for power up - more than 30ms for vdd to rise to 4.5V //
+        if(powerOn)
+        {
+            LCD_queue_push(panel, 100, LCD_Q_DELAY);
+        }
+        
+        //  Reset three times - more than 4.1ms after the first and 100us after the second  //
+        LCD_queue_push(panel, LCD_Reset, LCD_Q_NIBBLE);
+        LCD_queue_push(panel, 6, LCD_Q_DELAY);
+        LCD_queue_push(panel, LCD_Reset, LCD_Q_NIBBLE);
+        LCD_queue_push(panel, 2, LCD_Q_DELAY);  //  a delay entry can end up to 1ms early  //
+        LCD_queue_push(panel, LCD_Reset, LCD_Q_NIBBLE);
+        
+#if LCD_BUS_8BIT
+        //  The controller is already in 8-bit mode - every write is one transfer from here  //
+        LCD_write_instruction(panel, LCD_8bit_mode);  //  delay must be > 39us  //
+#else
+        //  Now we can set the LCD to 4-bit mode  //
+        LCD_queue_push(panel, LCD_4bit_enable, LCD_Q_NIBBLE);  //  delay must be > 39us  //
+        
+        
+        
+        ////////////////  system reset is complete - set up LCD modes  ////////////////////
+        //  At this point we are operating in 4-bit mode
+        //  (which means we have to send the high-nibble and low-nibble separate)
+        //  and can now set the line numbers and font size
+        //  Notice:  we queue single nibbles (LCD_Q_NIBBLE) when in 8-bit mode and use LCD_write_instruction()
+        //  (the interrupt sends this as two nibbles) once we're in 4-bit mode.
+        //  The set of instructions are found in Table 7 of the datasheet.  //
+        LCD_write_instruction(panel, LCD_4bit_mode);  //  delay must be > 39us  //
+#endif
+        
+        //  From page 26 (and Table 7) in the datasheet we need to:
+        //  display = off, display = clear, and entry mode = set //
+        LCD_write_instruction(panel, LCD_4bit_displayOFF);  //  delay must be > 39us  //
+        
+        LCD_write_instruction(panel, LCD_4bit_displayCLEAR);  //  delay must be > 1.53ms  //
+        LCD_clear_frame(panel);  //  frame buffer and shadow now match the blank display  //
+        
+        LCD_write_instruction(panel, LCD_4bit_entryMODE);  //  delay must be > 39us  //
+        
+        //  The LCD should now be initialized to operate in 4-bit mode, 2 lines, 5 x 8 dot fonstsize  //
+        //  Need to turn the display back on for use  //
+        LCD_write_instruction(panel, LCD_4bit_displayON);  //  delay must be > 39us  //
+        lcdDisplayCtrl[panel] = LCD_4bit_displayON;  //  Ctrl+O and Ctrl+E change it from here  //
+    }
 }
 
 void LCD_E_RS_init(void)
 {
     //  Set up the E and RS lines to active low for the reset function  //
-    PORTB &= ~(1<<LCD_EnablePin);
-    PORTB &= ~(1<<LCD_RegisterSelectPin);
+    for(uint8_t panel = 0; panel < LCD_PANELS; panel++)
+    {
+        hal_lcd_e(panel, 0);
+    }
+    hal_lcd_rs(0);
 }
 
-//  Send a byte of Data to the LCD module  //
-void LCD_write_4bits(uint8_t Data)
+//  Send a byte of Data to one LCD panel - the data lines are shared, only the panel's E line is pulsed  //
+void LCD_write_4bits(uint8_t panel, uint8_t Data)
 {
     //  We are only interested in sending the data to the upper 4 bits of PORTA //
-    PORTA &= 0b00001111;  //  Ensure the upper nybble of PORTA is cleared  //
-    PORTA |= Data;  // Write the data to the data lines on PORTA  //
+    hal_lcd_data(Data);  // Write the data to the data lines on PORTA  //
     
     //  The data is now sitting on the upper nybble of PORTA - need to pulse enable to send it //
-    LCD_EnablePulse();  //  Pulse the enable to write/read the data  //
+    LCD_EnablePulse(panel);  //  Pulse the enable to write/read the data  //
 }
 
-//  Write an instruction in 4-bit mode - need to send the upper nybble first and then the lower nybble  //
-void LCD_write_instruction(uint8_t Instruction)
+//  Send a whole byte at once on the 8-bit bus (LCD_BUS_8BIT) - one enable pulse per byte  //
+void LCD_write_8bits(uint8_t panel, uint8_t Data)
 {
-    //  ensure RS is low  //
-    //PORTB &= ~(1<<LCD_RegisterSelectPin);
-    LCD_E_RS_init();  //  Set the E and RS pins active low for each LCD reset  //
-    
-    LCD_write_4bits(Instruction);  //  write the high nybble first  //
-    LCD_write_4bits(Instruction<<4);  //  write the low nybble  //
-    
-    
+    hal_lcd_data(Data);  //  D0-D7 all on PORTA  //
+    LCD_EnablePulse(panel);
+}
+
+//  Send one queue entry's byte - in 4-bit mode as two nybbles, or one when single is set (8-bit mode reset)  //
+void LCD_write_bus(uint8_t panel, uint8_t Data, uint8_t single)
+{
+#if LCD_BUS_8BIT
+    (void)single;  //  every transfer is a whole byte  //
+    LCD_write_8bits(panel, Data);
+#else
+    LCD_write_4bits(panel, Data);  //  write the upper nybble  //
+    if(!single)
+    {
+        LCD_write_4bits(panel, Data << 4);  //  write the lower nybble  //
+    }
+#endif
+}
+
+//  Queue an instruction - the interrupt sends the upper nybble first and then the lower nybble  //
+void LCD_write_instruction(uint8_t panel, uint8_t Instruction)
+{
+    LCD_queue_push(panel, Instruction, LCD_Q_INSTR);
 }
 
 //  Pulse the Enable pin on the LCD controller to write/read the data lines - should be at least 230ns pulse width //
-void LCD_EnablePulse(void)
+void LCD_EnablePulse(uint8_t panel)
 {
-    //  Set the enable bit low -> high -> low  //
-    //PORTB &= ~(1<<LCD_EnablePin); // Set enable low //
-    //_delay_us(1);  //  wait to ensure the pin is low  //
-    PORTB |= (1<<LCD_EnablePin);  //  Set enable high  //
-    _delay_us(1);  //  wait to ensure the pin is high  //
-    PORTB &= ~(1<<LCD_EnablePin); // Set enable low //
-    _delay_us(1);  //  wait to ensure the pin is low  //
+    //  Set the enable bit low -> high -> low, timed in cycles from F_CPU  //
+    hal_lcd_e_pulse(panel);
 }
 
-//  write a character to the display  //
-void LCD_write_char(char Data)
+//  Queue a character for the display  //
+void LCD_write_char(uint8_t panel, char Data)
 {
-    //  Set up the E and RS lines for data writing  //
-    PORTB |= (1<<LCD_RegisterSelectPin);  //  Ensure RS pin is set high //
-    PORTB &= ~(1<<LCD_EnablePin);  //  Ensure the enable pin is low  //
-    LCD_write_4bits(Data);  //  write the upper nybble  //
-    LCD_write_4bits(Data<<4);  //  write the lower nybble  //
-    _delay_us(80);  //  need to wait > 43us  //
-    
+    LCD_queue_push(panel, Data, LCD_Q_DATA);
 }
 
 /*
- * Function:	LCD_write_str
- *  Writes the input string to the input line on the LCD screen. wraps line if
- *  it is too large for one line. Does not check if the string is too large 
- *  for two lines and will continue line wrapping. Checking if a string is too
- *  large for two LCD lines will be handled outside of this function.
+ * Function:	LCD_queue_push
+ *  Adds an entry to a panel's LCD command queue and makes sure the Timer2 
+ *  interrupt is running to send it. Only waits if the queue is full.
+ *  Timer2 keeps counting while the queue is idle, so its pending compare
+ *  flag is cleared and the count restarted when the interrupt is turned
+ *  back on - otherwise the first entry would go out right away and the
+ *  second one at the next compare match, which can be less than a tick
+ *  later.
  *
- *  arr		char[]	string to be written to LCD screen
- *  line	int*	LCD screen line to be cleared
+ *  panel	uint8_t	LCD panel, 0 to LCD_PANELS - 1
+ *  data	uint8_t	instruction, character, or delay in ms (LCD_Q_DELAY,
+ *			up to 254)
+ *  ctrl	uint8_t	LCD_Q_INSTR, LCD_Q_DATA, LCD_Q_NIBBLE or LCD_Q_DELAY
  *
- *  returns:  none
+ *  returns:	none
  */
-void LCD_write_str(char arr[MAX_INPUT], int* LCDLine){
-	int i = 0;	//array index counter
-	int count = 0;	//LCD line wrapping counter
+void LCD_queue_push(uint8_t panel, uint8_t data, uint8_t ctrl){
+	uint8_t next = (lcdQueueHead[panel] + 1) & LCD_QUEUE_MASK;
+	
+	while(next == lcdQueueTail[panel]) hal_wait();	//wait for space in the queue
+	
+	lcdQueueData[panel][lcdQueueHead[panel]] = data;
+	lcdQueueCtrl[panel][lcdQueueHead[panel]] = ctrl;
+	lcdQueueHead[panel] = next;
+	//queues were idle (this panel not in a delay) - start a full tick from
+	//now so the first two entries are a tick apart
+	if(!hal_lcd_timer_irq_enabled() && lcdDelayMs[panel] == 0){
+		hal_lcd_timer_start();
+	}
+	return;
+}
+
+/*
+ * Function:	LCD_queue_idle
+ *  Checks if every LCD panel has finished its queued writes and delays.
+ *
+ *  returns:	0	a queue is still being sent
+ *		1	queues are empty and the LCDs are ready
+ */
+uint8_t LCD_queue_idle(void){
+	for(uint8_t panel = 0; panel < LCD_PANELS; panel++){
+		if(lcdQueueHead[panel] != lcdQueueTail[panel]){
+			return 0;
+		}
+	}
+	return !hal_lcd_timer_irq_enabled();
+}
+
+/*
+ * Function:	LCD_timer_init
+ *  Sets up timer2 in CTC mode with an 8 prescaler so the compare match A
+ *  interrupt fires every LCD_TICK_US microseconds. The interrupt is only
+ *  enabled while the LCD command queue has work in it.
+ *
+ *  returns:	none
+ */
+void LCD_timer_init(void){
+	hal_lcd_timer_init(LCD_TICK_CYCLES - 1);
+	return;
+}
+
+/*
+ * ISR:  TIMER2_COMPA_vect
+ *  Interrupt for the LCD queue tick. For each panel, counts down the wait 
+ *  left from the previous entry, then sends the next queued entry and 
+ *  loads the wait it needs. The panels share the data bus but not E, so 
+ *  one panel's execution time overlaps the transfers to the others. A 
+ *  tick is longer than the 43 us a normal instruction or character takes,
+ *  so only clear/home entries wait extra ticks. A delay entry leaves its
+ *  panel to the 1 ms system tick. A stream entry stays at the head of the
+ *  queue and sends one char of its row buffer each time it comes up, so a
+ *  whole row goes out at the fastest rate the LCD takes without the main
+ *  loop queueing each char. With LCD_USE_BUSY_FLAG the busy flag is
+ *  polled every tick after a full write instead, so the next entry goes 
+ *  out as soon as the LCD is ready. Disables itself once no panel has 
+ *  anything left to send or wait for.
+ *
+ *  returns:	none
+ */
+ISR(TIMER2_COMPA_vect) {
+	uint8_t data;
+	uint8_t ctrl;
+	uint8_t row;
+	uint8_t active = 0;			//a panel still needs the tick
 	
-	//set line to write
-	if(*LCDLine == 0){	//write to line 1
-		LCD_write_instruction(LCD_4bit_cursorSET | LineOneStart);
+	for(uint8_t panel = 0; panel < LCD_PANELS; panel++){
+		if(lcdDelayMs[panel] != 0){		//system tick owns this panel
+			continue;
+		}
+		if(lcdStreamBusy[panel]){		//time streams by the ticks they take
+			lcdStreamTicks++;
+		}
+		if(lcdWaitTicks[panel] != 0){		//previous entry still executing
+			lcdWaitTicks[panel]--;
+			active = 1;
+			continue;
+		}
+#if LCD_USE_BUSY_FLAG
+		if(lcdCheckBusy[panel]){
+			if(LCD_read_busy(panel)){	//LCD still executing, poll again
+				active = 1;
+				continue;
+			}
+			lcdCheckBusy[panel] = 0;
+		}
+#endif
+		if(lcdQueueHead[panel] == lcdQueueTail[panel]){	//nothing left to send
+			continue;
+		}
+		
+		data = lcdQueueData[panel][lcdQueueTail[panel]];
+		ctrl = lcdQueueCtrl[panel][lcdQueueTail[panel]];
+		
+		if(ctrl & LCD_Q_DELAY){			//delay only, data is in ms
+			lcdDelayMs[panel] = data + 1;	//first tick can be right away
+			continue;
+		}
+		if(ctrl & LCD_Q_STREAM){		//next char of a row, data is the row
+			if(!lcdStreamBusy[panel]){	//first char, count this tick
+				lcdStreamBusy[panel] = 1;
+				lcdStreamTicks++;
+			}
+			lcdStreamChars++;
+			row = data;
+			ctrl = LCD_Q_DATA;
+			data = lcdStreamBuf[panel][row][lcdStreamCol[panel][row]++];
+			if(lcdStreamCol[panel][row] == lcdStreamEnd[panel][row]){
+				lcdStreamBusy[panel] = 0;	//row is done
+				lcdQueueTail[panel] = (lcdQueueTail[panel] + 1) & LCD_QUEUE_MASK;
+			}
+		}
+		else{
+			lcdQueueTail[panel] = (lcdQueueTail[panel] + 1) & LCD_QUEUE_MASK;
+		}
+		active = 1;				//one more tick for it to execute
+		
+		//set RS for data or instruction - E is already low, every pulse ends low
+		hal_lcd_rs(ctrl & LCD_Q_DATA);
+		
+		LCD_write_bus(panel, data, ctrl & LCD_Q_NIBBLE);
+		statLcdWrites++;
+		if(ctrl == LCD_Q_INSTR && data == LCD_4bit_displayCLEAR){
+			statLcdClears++;
+		}
+		
+#if LCD_USE_BUSY_FLAG
+		//busy flag can only be read once the reset writes are done
+		if(!(ctrl & LCD_Q_NIBBLE)){
+			lcdCheckBusy[panel] = 1;
+		}
+		else{
+			lcdWaitTicks[panel] = LCD_EXEC_TICKS - 1;
+		}
+#else
+		//clear display and return home take up to 1.53 ms
+		if(!(ctrl & (LCD_Q_DATA | LCD_Q_NIBBLE)) && data != 0 && data < 0x04){
+			lcdWaitTicks[panel] = LCD_CLEAR_TICKS;
+		}
+#endif
 	}
-	else{			//write to line 2
-		LCD_write_instruction(LCD_4bit_cursorSET | LineTwoStart);
+	if(!active){
+		hal_lcd_timer_irq(0);
+		if(statLineState == STAT_LINE_QUEUED){	//last write of the line is done
+			stat_add(&statLineLcd, micros_irqoff() - statLineStart);
+			statLineState = STAT_LINE_IDLE;
+		}
 	}
-	_delay_us(80);		//short delay for LCD to update
+	return;
+}
+
+#if LCD_USE_BUSY_FLAG
+/*
+ * Function:	LCD_read_busy
+ *  Reads the busy flag from D7 (PORTA7). The data lines are switched to 
+ *  inputs and RW is driven high for the read. In 4-bit mode the read takes
+ *  two enable pulses - BF comes with the upper nybble, and the lower nybble
+ *  (rest of the address counter) is clocked out and ignored. On the 8-bit
+ *  bus one pulse reads it all.
+ *
+ *  panel	uint8_t	LCD panel to read - only its E line is pulsed
+ *
+ *  returns:	0	LCD is ready for the next instruction or char
+ *		else	LCD is still busy
+ */
+uint8_t LCD_read_busy(uint8_t panel){
+	uint8_t busy;
+	
+	hal_lcd_data_dir(0);			//data lines to inputs
+	hal_lcd_rs(0);				//read from instruction register
+	hal_lcd_rw(1);				//RW high for read
+	
+	hal_lcd_e(panel, 1);			//upper nybble, BF on D7
+	hal_delay_us(1);			//data valid after tDDR
+	busy = hal_lcd_busy_flag();
+	hal_lcd_e(panel, 0);
+	hal_delay_us(1);
+#if !LCD_BUS_8BIT
+	LCD_EnablePulse(panel);			//lower nybble, ignored
+#endif
+	
+	hal_lcd_rw(0);				//back to write
+	hal_lcd_data_dir(1);			//data lines to outputs
+	return busy;
+}
+#endif
+
+/*
+ * Function:	LCD_write_chars
+ *  Writes a string to the input line of the LCD frame buffer of the 
+ *  selected panel (lcdPanel). wraps line if it is too large for one line. 
+ *  Does not check if the string is too large for two lines and will 
+ *  continue line wrapping. Checking if a string is too large for two LCD 
+ *  lines will be handled outside of this function.
+ *  Nothing is sent to the LCD until LCD_flush is called. The string can be
+ *  in SRAM or in flash - each caller passes a constant, so the compiler 
+ *  makes one copy for each.
+ *
+ *  arr		char*	string to be written to LCD screen
+ *  fromFlash	uint8_t	1 if arr is in program memory (PROGMEM)
+ *  line	int*	LCD screen line to be written
+ *
+ *  returns:  none
+ */
+static inline void LCD_write_chars(const char* arr, uint8_t fromFlash, int* LCDLine){
+	int i = 0;	//array index counter
+	int count = 0;	//LCD line wrapping counter
+	char c = fromFlash ? pgm_read_byte(&arr[0]) : arr[0];
 	
 	//loop to write chars to line until null terminator is encountered
-	while(arr[i] != '\0'){
-		LCD_write_char(arr[i]);	//write current char
+	while(c != '\0'){
+		lcdFrame[lcdPanel][*LCDLine][count] = c;	//write current char
 		i++;			//increment index counter for array
 		count++;		//increment line wrapping counter
+		c = fromFlash ? pgm_read_byte(&arr[i]) : arr[i];
 		
-		if(arr[i] != '\0'){
+		if(c != '\0'){
 			//check if line needs to be wrapped
-			if(count > 15){
+			if(count >= LCD_COLS){
 				count = 0;		//reset line wrapping counter
-				*LCDLine ^= 0x01;	//update current LCD line
-				
-							//change LCD line
-				if(*LCDLine == 0){	//select LCD line 1
-					LCD_write_instruction(LCD_4bit_cursorSET | LineOneStart);
-				}
-				else{			//select LDC line 2
-					LCD_write_instruction(LCD_4bit_cursorSET | LineTwoStart);
-				}
-				_delay_us(80);		//short delay for LCD to update
+				*LCDLine = LCD_NEXT_ROW(*LCDLine);	//update current LCD line
 			}
 		}
 	}
-	*LCDLine ^= 0x01;	//change current LCD line
-	return;
+	*LCDLine = LCD_NEXT_ROW(*LCDLine);	//change current LCD line
+	return;
+}
+
+/*
+ * Function:	LCD_write_str
+ *  Writes the input string to the input line of the LCD frame buffer of the
+ *  selected panel, see LCD_write_chars.
+ *
+ *  arr		char[]	string to be written to LCD screen
+ *  line	int*	LCD screen line to be written
+ *
+ *  returns:  none
+ */
+void LCD_write_str(char arr[MAX_INPUT], int* LCDLine){
+	LCD_write_chars(arr, 0, LCDLine);
+	return;
+}
+
+/*
+ * Function:	LCD_write_str_P
+ *  Writes a string from flash (PSTR) to the input line of the LCD frame 
+ *  buffer of the selected panel, see LCD_write_chars.
+ *
+ *  arr		char*	string in program memory
+ *  line	int*	LCD screen line to be written
+ *
+ *  returns:  none
+ */
+void LCD_write_str_P(const char* arr, int* LCDLine){
+	LCD_write_chars(arr, 1, LCDLine);
+	return;
+}
+
+/*
+ * Function:	LCD_clear_line
+ *  Clears a line of the selected panel's LCD frame buffer based on the 
+ *  input pointer. The value the pointer is pointing at is left on the line
+ *  that was cleared.
+ *
+ *  line	int*	LCD screen line to be cleared
+ *
+ *  returns:  none
+ */
+void LCD_clear_line(int* line){
+	memset(lcdFrame[lcdPanel][*line], ' ', LCD_ROW_CELLS);	//fill line with spaces
+	return;
+}
+
+/*
+ * Function:	LCD_clear_frame
+ *  Fills a panel's LCD frame buffer and DDRAM shadow with spaces to match a
+ *  display that was just cleared with LCD_4bit_displayCLEAR, and puts the 
+ *  tracked cursor at the start of line 1.
+ *
+ *  panel	uint8_t	LCD panel that was cleared
+ *
+ *  returns:  none
+ */
+void LCD_clear_frame(uint8_t panel){
+	memset(lcdFrame[panel], ' ', sizeof(lcdFrame[panel]));
+	memset(lcdShadow[panel], ' ', sizeof(lcdShadow[panel]));
+	lcdCursorAddr[panel] = LCD_ROW_START(0);
+	return;
+}
+
+/*
+ * Function:	LCD_flush
+ *  Compares each panel's LCD frame buffer with its DDRAM shadow and queues
+ *  writes for only the cells that changed. When LCD_STREAM_MIN or more 
+ *  cells of a row changed, the span from the first to the last changed 
+ *  cell is copied to the row's stream buffer and sent by the interrupt as
+ *  one queue entry (unchanged cells inside the span are sent again, which
+ *  costs no more than the cursor sets it saves). Otherwise each changed 
+ *  cell is queued, with a cursor set only at the start of a run of 
+ *  changed cells, since the LCD moves the cursor right after every char 
+ *  (or after a CGRAM write left it in CGRAM). A row whose last stream is 
+ *  still being sent also takes this path. Every panel has its own queue, 
+ *  so the writes to different panels go out side by side. With the cursor
+ *  or blink on, the LCD cursor is moved back to the text cursor last.
+ *
+ *  Old text is only overwritten where it differs, so a new line over an 
+ *  old one costs its own chars plus spaces over the old tail. When most 
+ *  of a panel is being blanked, LCD_clear_cheaper picks the clear display
+ *  instruction instead, and only the text left in the frame is redrawn.
+ *
+ *  returns:  none
+ */
+void LCD_flush(void){
+	uint8_t addr;
+	uint8_t first, last, changed;
+	
+	for(uint8_t panel = 0; panel < LCD_PANELS; panel++){
+		if(LCD_clear_cheaper(panel)){
+			LCD_write_instruction(panel, LCD_4bit_displayCLEAR);
+			memset(lcdShadow[panel], ' ', sizeof(lcdShadow[panel]));
+			lcdCursorAddr[panel] = LCD_ROW_START(0);
+		}
+		for(uint8_t row = 0; row < LCD_ROWS; row++){
+			changed = 0;
+			first = 0;
+			last = 0;
+			for(uint8_t col = 0; col < LCD_ROW_CELLS; col++){
+				if(lcdFrame[panel][row][col] != lcdShadow[panel][row][col]){
+					if(changed++ == 0){
+						first = col;
+					}
+					last = col;
+				}
+			}
+			if(changed == 0){
+				continue;		//row is already on screen
+			}
+			
+			addr = LCD_ROW_START(row) + first;
+			if(changed >= LCD_STREAM_MIN
+			   && lcdStreamCol[panel][row] == lcdStreamEnd[panel][row]){
+				for(uint8_t col = first; col <= last; col++){
+					lcdStreamBuf[panel][row][col] = lcdFrame[panel][row][col];
+					lcdShadow[panel][row][col] = lcdFrame[panel][row][col];
+				}
+				lcdStreamCol[panel][row] = first;
+				lcdStreamEnd[panel][row] = last + 1;
+				if(addr != lcdCursorAddr[panel]){
+					LCD_write_instruction(panel, LCD_4bit_cursorSET | addr);
+				}
+				LCD_queue_push(panel, row, LCD_Q_STREAM);
+				lcdCursorAddr[panel] = addr + last + 1 - first;
+				continue;
+			}
+			
+			for(uint8_t col = first; col <= last; col++){
+				if(lcdFrame[panel][row][col] == lcdShadow[panel][row][col]){
+					continue;	//cell is already on screen
+				}
+				
+				addr = LCD_ROW_START(row) + col;
+				if(addr != lcdCursorAddr[panel]){	//start of a new run
+					LCD_write_instruction(panel, LCD_4bit_cursorSET | addr);
+				}
+				LCD_write_char(panel, lcdFrame[panel][row][col]);
+				lcdShadow[panel][row][col] = lcdFrame[panel][row][col];
+				lcdCursorAddr[panel] = addr + 1;
+			}
+		}
+		//a visible cursor is left on the text cursor
+		if((lcdDisplayCtrl[panel] & (LCD_CURSOR_ON | LCD_BLINK_ON))
+		   && lcdCursorAddr[panel] != lcdShowAddr[panel]){
+			LCD_write_instruction(panel, LCD_4bit_cursorSET | lcdShowAddr[panel]);
+			lcdCursorAddr[panel] = lcdShowAddr[panel];
+		}
+	}
+	return;
+}
+
+/*
+ * Function:	LCD_clear_cheaper
+ *  Compares two ways of sending a panel's frame buffer. Writing the cells
+ *  that changed costs one write each, plus a cursor set per row. A clear 
+ *  display costs LCD_CLEAR_COST, plus a write for each cell that is not a
+ *  space and a cursor set per row holding text. The clear also undoes the 
+ *  display shift, so it is never used while the terminal is scrolled 
+ *  sideways with TERM_HW_SHIFT.
+ *
+ *  panel	uint8_t	LCD panel to check
+ *
+ *  returns:	1	the clear display instruction is cheaper
+ *		0	write only the changed cells
+ */
+uint8_t LCD_clear_cheaper(uint8_t panel){
+	uint16_t writeCost = 0;
+	uint16_t clearCost = LCD_CLEAR_COST;
+	uint8_t rowChanged, rowText;
+	
+#if TERM_HW_SHIFT
+	if(termMode && panel == termPanel && termScroll != 0){
+		return 0;
+	}
+#endif
+	for(uint8_t row = 0; row < LCD_ROWS; row++){
+		rowChanged = 0;
+		rowText = 0;
+		for(uint8_t col = 0; col < LCD_ROW_CELLS; col++){
+			if(lcdFrame[panel][row][col] != lcdShadow[panel][row][col]){
+				writeCost++;
+				rowChanged = 1;
+			}
+			if(lcdFrame[panel][row][col] != ' '){
+				clearCost++;
+				rowText = 1;
+			}
+		}
+		writeCost += rowChanged;
+		clearCost += rowText;
+	}
+	return clearCost < writeCost;
+}
+
+/*
+ * Function:	glyph_init
+ *  Marks every CGRAM slot of every panel empty and builds the bar graph 
+ *  and sparkline glyphs. User glyphs start blank until FRAME_OP_GLYPH sets
+ *  them.
+ *
+ *  returns:	none
+ */
+void glyph_init(void){
+	uint8_t rows[8];
+	
+	memset(glyphSlot, GLYPH_NONE, sizeof(glyphSlot));
+	memset(glyphSlotId, GLYPH_NONE, sizeof(glyphSlotId));
+	for(uint8_t panel = 0; panel < LCD_PANELS; panel++){
+		for(uint8_t i = 0; i < GLYPH_SLOTS; i++){
+			glyphLru[panel][i] = i;
+		}
+	}
+	
+	for(uint8_t n = 1; n <= 4; n++){	//bar cell, n dots from the left
+		memset(rows, (0x1F << (5 - n)) & 0x1F, sizeof(rows));
+		glyph_define(GLYPH_BAR_FIRST + n - 1, rows);
+	}
+	for(uint8_t n = 1; n <= 7; n++){	//sparkline cell, n dots from the bottom
+		memset(rows, 0x00, 8 - n);
+		memset(rows + 8 - n, 0x1F, n);
+		glyph_define(GLYPH_SPARK_FIRST + n - 1, rows);
+	}
+	return;
+}
+
+/*
+ * Function:	glyph_define
+ *  Sets the dots of a glyph id. Panels that already hold the id get the 
+ *  new dots right away, so cells showing it change without a redraw.
+ *
+ *  id		uint8_t		glyph id, 0 to GLYPH_IDS - 1
+ *  rows	uint8_t[]	8 rows top to bottom, bit 4 is the left dot
+ *
+ *  returns:	none
+ */
+void glyph_define(uint8_t id, const uint8_t rows[8]){
+	for(uint8_t i = 0; i < 8; i++){
+		glyphBitmap[id][i] = rows[i] & 0x1F;
+	}
+	for(uint8_t panel = 0; panel < LCD_PANELS; panel++){
+		if(glyphSlot[panel][id] != GLYPH_NONE){
+			glyph_upload(panel, glyphSlot[panel][id], id);
+		}
+	}
+	return;
+}
+
+/*
+ * Function:	glyph_use
+ *  Gets the DDRAM code that shows a glyph on a panel. A glyph already in 
+ *  CGRAM costs nothing but moving its slot to the front of the LRU list.
+ *  Otherwise the least recently used slot is loaded with it, and any cell 
+ *  still showing the glyph it held changes too - a panel can only show 
+ *  GLYPH_SLOTS different glyphs at once.
+ *
+ *  panel	uint8_t		LCD panel
+ *  id		uint8_t		glyph id, 0 to GLYPH_IDS - 1
+ *
+ *  returns:	uint8_t		char to put in the frame buffer
+ */
+uint8_t glyph_use(uint8_t panel, uint8_t id){
+	uint8_t slot = glyphSlot[panel][id];
+	uint8_t i;
+	
+	if(slot == GLYPH_NONE){			//miss, take the oldest slot
+		slot = glyphLru[panel][GLYPH_SLOTS - 1];
+		if(glyphSlotId[panel][slot] != GLYPH_NONE){
+			glyphSlot[panel][glyphSlotId[panel][slot]] = GLYPH_NONE;
+		}
+		glyphSlotId[panel][slot] = id;
+		glyphSlot[panel][id] = slot;
+		glyph_upload(panel, slot, id);
+	}
+	
+	for(i = 0; glyphLru[panel][i] != slot; i++);	//find it in the LRU list
+	for(; i > 0; i--){				//and move it to the front
+		glyphLru[panel][i] = glyphLru[panel][i - 1];
+	}
+	glyphLru[panel][0] = slot;
+	return GLYPH_CHAR(slot);
+}
+
+/*
+ * Function:	glyph_upload
+ *  Queues the 8 rows of a glyph into a CGRAM slot. This leaves the LCD 
+ *  address counter in CGRAM, so the next LCD_flush starts with a cursor 
+ *  set.
+ *
+ *  panel	uint8_t		LCD panel
+ *  slot	uint8_t		CGRAM slot, 0 to GLYPH_SLOTS - 1
+ *  id		uint8_t		glyph id to load
+ *
+ *  returns:	none
+ */
+void glyph_upload(uint8_t panel, uint8_t slot, uint8_t id){
+	LCD_write_instruction(panel, LCD_4bit_cgramSET | (slot << 3));
+	for(uint8_t i = 0; i < 8; i++){
+		LCD_write_char(panel, glyphBitmap[id][i]);
+	}
+	lcdCursorAddr[panel] = LCD_CURSOR_NONE;
+	return;
+}
+
+/*
+ * Function:	widget_bar
+ *  Draws a horizontal bar graph into the selected panel's frame buffer. 
+ *  Each cell is 5 dots wide, so the bar has width * 5 steps. Full cells 
+ *  use the ROM block char and only the cell at the end of the bar needs a
+ *  glyph. Nothing is drawn if row or col is off the screen or max is 0.
+ *
+ *  row		uint8_t		LCD row
+ *  col		uint8_t		first column, the bar is clipped at the row end
+ *  width	uint8_t		cells in the bar
+ *  value	uint8_t		bar length, 0 to max
+ *  max		uint8_t		value of a full bar (not 0)
+ *
+ *  returns:	none
+ */
+void widget_bar(uint8_t row, uint8_t col, uint8_t width, uint8_t value, uint8_t max){
+	uint16_t dots;
+	char c;
+	
+	if(row >= LCD_ROWS || col >= LCD_COLS || max == 0){
+		return;
+	}
+	if(value > max){
+		value = max;
+	}
+	if(width > LCD_COLS - col){
+		width = LCD_COLS - col;
+	}
+	dots = ((uint16_t)value * width * 5 + max / 2) / max;
+	
+	for(uint8_t i = 0; i < width; i++){
+		if(dots >= 5){
+			c = LCD_CHAR_BLOCK;
+			dots -= 5;
+		}
+		else if(dots > 0){
+			c = glyph_use(lcdPanel, GLYPH_BAR_FIRST + dots - 1);
+			dots = 0;
+		}
+		else{
+			c = ' ';
+		}
+		lcdFrame[lcdPanel][row][col + i] = c;
+	}
+	return;
+}
+
+/*
+ * Function:	widget_sparkline
+ *  Draws a sparkline into the selected panel's frame buffer, one cell per
+ *  value with 8 dots of height each. Uses up to 7 glyphs. Nothing is drawn
+ *  if row or col is off the screen or max is 0.
+ *
+ *  row		uint8_t		LCD row
+ *  col		uint8_t		first column, values past the row end are dropped
+ *  values	uint8_t*	values, 0 to max
+ *  count	uint8_t		number of values
+ *  max		uint8_t		value of a full height cell (not 0)
+ *
+ *  returns:	none
+ */
+void widget_sparkline(uint8_t row, uint8_t col, uint8_t* values, uint8_t count, uint8_t max){
+	uint8_t dots;
+	char c;
+	
+	if(row >= LCD_ROWS || col >= LCD_COLS || max == 0){
+		return;
+	}
+	if(count > LCD_COLS - col){
+		count = LCD_COLS - col;
+	}
+	for(uint8_t i = 0; i < count; i++){
+		dots = values[i] >= max ? 8 : ((uint16_t)values[i] * 8 + max / 2) / max;
+		if(dots == 8){
+			c = LCD_CHAR_BLOCK;
+		}
+		else if(dots > 0){
+			c = glyph_use(lcdPanel, GLYPH_SPARK_FIRST + dots - 1);
+		}
+		else{
+			c = ' ';
+		}
+		lcdFrame[lcdPanel][row][col + i] = c;
+	}
+	return;
+}
+
+/*
+ * Function:	initializeTimers
+ *  Starts the SYS_TICK_HZ system tick on timer0 (CTC mode, compare match A
+ *  interrupt) and enables global interrupts.
+ *
+ *  returns:	none
+ */
+void initializeTimers(){
+   	hal_timer0_init(SYS_TICK_TOP);	//turn timer0 on in CTC mode with
+   					//compare match interrupt
+ 
+   	sei();    		//Enable global interrupts by setting global interrupt enable
+                		//bit in SREG
+   	
+   	return;
+}
+
+/*
+ * Function:	millis
+ *  Returns the number of system ticks (ms) since the timer was started. 
+ *  Wraps after about 49 days.
+ *
+ *  returns:	uint32_t	milliseconds since start up
+ */
+uint32_t millis(void){
+	uint32_t ms;
+	
+	cli();				//4 byte read, keep the tick out
+	ms = sysMillis;
+	sei();
+	return ms;
+}
+
+/*
+ * Function:	micros
+ *  Returns the time since the system tick was started in microseconds, 
+ *  from millis() and the Timer0 count (4 us steps). Wraps after about 71
+ *  minutes, so only differences should be used.
+ *
+ *  returns:	uint32_t	microseconds since start up
+ */
+uint32_t micros(void){
+	uint32_t us;
+	
+	cli();
+	us = micros_irqoff();
+	sei();
+	return us;
+}
+
+/*
+ * Function:	micros_irqoff
+ *  micros() for callers that already have interrupts off, such as 
+ *  interrupt handlers. A compare match whose interrupt has not run yet 
+ *  (the count has wrapped to a small value) is added to the ticks.
+ *
+ *  returns:	uint32_t	microseconds since start up
+ */
+uint32_t micros_irqoff(void){
+	uint32_t ms = sysMillis;
+	uint8_t count = hal_timer0_count();
+	
+	if(hal_timer0_pending() && count < SYS_TICK_TOP / 2){
+		ms++;
+	}
+	return ms * 1000 + (uint32_t)count * (1000000UL / SYS_TICK_HZ) / (SYS_TICK_TOP + 1);
+}
+
+/*
+ * Function:	stat_add
+ *  Adds a sample to a statistic. Costs a few compares and at most 
+ *  STAT_BUCKETS shifts. A full bucket stops at 65535.
+ *
+ *  stat	struct stat_hist*	statistic to add to
+ *  us		uint32_t		sample in microseconds
+ *
+ *  returns:	none
+ */
+void stat_add(struct stat_hist* stat, uint32_t us){
+	uint32_t v = us >> STAT_SHIFT;
+	uint8_t bucket = 0;
+	
+	while(v != 0 && bucket < STAT_BUCKETS - 1){
+		v >>= 1;
+		bucket++;
+	}
+	if(stat->count == 0 || us < stat->min){
+		stat->min = us;
+	}
+	if(us > stat->max){
+		stat->max = us;
+	}
+	stat->sum += us;
+	stat->count++;
+	if(stat->bucket[bucket] != 0xFFFF){
+		stat->bucket[bucket]++;
+	}
+	return;
+}
+
+/*
+ * Function:	stat_print
+ *  Sends one statistic on a line: the name, sample count, min/avg/max in 
+ *  microseconds and the histogram buckets from bucket 0 up.
+ *
+ *  name	char*			label for the line, in flash (PSTR)
+ *  stat	struct stat_hist*	statistic to send
+ *
+ *  returns:	none
+ */
+void stat_print(const char* name, struct stat_hist* stat){
+	fputs_P(name, uartOut);
+	fprintf_P(uartOut, PSTR(" n=%lu min=%lu avg=%lu max=%lu h="),
+		(unsigned long)stat->count, (unsigned long)stat->min,
+		(unsigned long)(stat->count ? stat->sum / stat->count : 0),
+		(unsigned long)stat->max);
+	for(uint8_t i = 0; i < STAT_BUCKETS; i++){
+		fprintf_P(uartOut, i ? PSTR(",%u") : PSTR("%u"), (unsigned)stat->bucket[i]);
+	}
+	fputs_P(PSTR("\n\r"), uartOut);
+	return;
+}
+
+/*
+ * Function:	soft_timer_start
+ *  Starts or restarts a soft timer. When it runs out its task bit is posted
+ *  to the scheduler. A timer with a period starts again by itself.
+ *
+ *  id		uint8_t		SOFT_TIMER_* number
+ *  ms		uint16_t	time to the first expiry
+ *  period	uint16_t	time between later expiries, 0 for one shot
+ *
+ *  returns:	none
+ */
+void soft_timer_start(uint8_t id, uint16_t ms, uint16_t period){
+	cli();
+	softTimerLeft[id] = ms < 0xFFFF ? ms + 1 : ms;	//the next tick can be right away,
+							//and 65535 must not wrap to 0 (stopped)
+	softTimerPeriod[id] = period;
+	sei();
+	return;
+}
+
+/*
+ * Function:	soft_timer_stop
+ *  Stops a soft timer without posting its task.
+ *
+ *  id		uint8_t		SOFT_TIMER_* number
+ *
+ *  returns:	none
+ */
+void soft_timer_stop(uint8_t id){
+	cli();
+	softTimerLeft[id] = 0;
+	sei();
+	return;
+}
+
+/*
+ * Function:	InitUSART
+ *  Sets up a USART to use a baudrate equal to the global constant 
+ *  USART_BAUDRATE (in double speed mode if BAUD_U2X is set), and use 8 bit
+ *  character frames and async mode. The receive complete interrupt is 
+ *  enabled so incoming bytes are buffered while the main loop is busy.
+ *
+ *  port	uint8_t	USART number, 0 to UART_PORTS - 1
+ *
+ *  returns:	none
+ */
+void InitUSART(uint8_t port){
+	//Enable RX, TX and receive complete interrupt, use 8 bit character
+	//frames in async mode and set baud rate
+	hal_uart_init(port, BAUD_PRESCALE, BAUD_U2X);
+#if UART_FLOW == UART_FLOW_RTSCTS
+	if(port == 0){
+		hal_uart_flow_init();	//RTS low, ready to receive
+	}
+#endif
+	return;
+}
+
+/*
+ * Function:	uart_stream
+ *  Returns the output stream of a USART.
+ *
+ *  port	uint8_t	USART number, 0 to UART_PORTS - 1
+ *
+ *  returns:	FILE*	stream that sends to the port
+ */
+FILE* uart_stream(uint8_t port){
+	switch(port){
+#if UART_PORTS > 1
+	case 1:
+		return USART1_OUT;
+#endif
+#if UART_PORTS > 2
+	case 2:
+		return USART2_OUT;
+#endif
+#if UART_PORTS > 3
+	case 3:
+		return USART3_OUT;
+#endif
+	default:
+		return USART0_OUT;
+	}
+}
+
+/*
+ * Function:	uart_putchar
+ *  Function to send chars to a USART. The char is queued in the port's 
+ *  transmit ring buffer and sent by the UDRE interrupt, so this only waits 
+ *  if the buffer is full.
+ *
+ *  port	uint8_t	USART number, 0 to UART_PORTS - 1
+ *  c		char	character to be transmitted through the serial line
+ *
+ *  returns:	none
+ */
+void uart_putchar(uint8_t port, char c){
+	if(c == '\n') uart_write(port, '\r');	//change newlines to return 
+						//carriage
+	uart_write(port, c);
+	return;
+}
+
+/*
+ * Function:	uart_putchar0
+ *  Function to send chars to USART0. Used to setup USART0_OUT as a file
+ *  pointer to the serial port so that data can be sent there. 
+ *  uart_putchar1-3 do the same for USART1_OUT-USART3_OUT.
+ *
+ *  c		char	character to be transmitted through the serial line
+ *  stream	FILE*	pointer for USART0 output
+ *
+ *  returns:	0	successful function run
+ */
+int uart_putchar0(char c, FILE* stream){
+	uart_putchar(0, c);
+	return 0;
+}
+
+#if UART_PORTS > 1
+int uart_putchar1(char c, FILE* stream){
+	uart_putchar(1, c);
+	return 0;
+}
+#endif
+
+#if UART_PORTS > 2
+int uart_putchar2(char c, FILE* stream){
+	uart_putchar(2, c);
+	return 0;
+}
+#endif
+
+#if UART_PORTS > 3
+int uart_putchar3(char c, FILE* stream){
+	uart_putchar(3, c);
+	return 0;
+}
+#endif
+
+/*
+ * Function:	uart_write
+ *  Queues a byte in a USART's transmit ring buffer as is (no newline 
+ *  translation) and makes sure the UDRE interrupt is sending. Only waits if
+ *  the buffer is full.
+ *
+ *  port	uint8_t	USART number, 0 to UART_PORTS - 1
+ *  c		uint8_t	byte to be transmitted
+ *
+ *  returns:	none
+ */
+void uart_write(uint8_t port, uint8_t c){
+	uint8_t next;
+	
+	next = (uartTxHead[port] + 1) & UART_TX_BUFFER_MASK;
+	while(next == uartTxTail[port]) hal_wait();	//wait for space in buffer
+	
+	uartTxBuf[port][uartTxHead[port]] = c;		//queue next character
+	uartTxHead[port] = next;
+	hal_uart_tx_irq(port, 1);			//start/continue transmit
+	return;
+}
+
+/*
+ * Function:	uart_available
+ *  Returns the number of received bytes waiting in a USART's receive ring
+ *  buffer.
+ *
+ *  port	uint8_t	USART number, 0 to UART_PORTS - 1
+ *
+ *  returns:	uint8_t	number of buffered bytes
+ */
+uint8_t uart_available(uint8_t port){
+	return (uartRxHead[port] - uartRxTail[port]) & UART_RX_BUFFER_MASK;
+}
+
+/*
+ * Function:	uart_read
+ *  Takes the next byte out of a USART's receive ring buffer, waiting until
+ *  one arrives. Once a stopped USART0 host's bytes are down to 
+ *  UART_RX_GO_AT, it is told to go on.
+ *
+ *  port	uint8_t	USART number, 0 to UART_PORTS - 1
+ *
+ *  returns:	uint8_t	received byte
+ */
+uint8_t uart_read(uint8_t port){
+	uint8_t c;
+	
+	while(uartRxHead[port] == uartRxTail[port]) hal_wait();	//wait for a byte
+	c = uartRxBuf[port][uartRxTail[port]];
+	uartRxTail[port] = (uartRxTail[port] + 1) & UART_RX_BUFFER_MASK;
+#if UART_FLOW != UART_FLOW_NONE
+	if(port == 0 && uartRxStopped && uart_available(0) <= UART_RX_GO_AT){
+		cli();
+		uart_flow(1);
+		sei();
+	}
+#endif
+	return c;
+}
+
+/*
+ * Function:	uart_peek
+ *  Returns the next byte in a USART's receive ring buffer without taking
+ *  it out, waiting until one arrives.
+ *
+ *  port	uint8_t	USART number, 0 to UART_PORTS - 1
+ *
+ *  returns:	uint8_t	next received byte
+ */
+uint8_t uart_peek(uint8_t port){
+	while(uartRxHead[port] == uartRxTail[port]) hal_wait();	//wait for a byte
+	return uartRxBuf[port][uartRxTail[port]];
+}
+
+
+/*
+ * Function:	getInput
+ *  Builds a line from a USART in the input array. Only the bytes already in
+ *  the receive ring buffer are taken, so it never waits - call it again 
+ *  with the same array when more arrive. A line ends at CR, LF or CRLF (the
+ *  LF of a CRLF pair is dropped). At most MAX_INPUT - 1 chars are stored; 
+ *  the rest of a longer line is read and thrown away so the next line 
+ *  starts clean. Each port keeps its own partial line.
+ *
+ *  port	uint8_t	USART number, 0 to UART_PORTS - 1
+ *  input	char[]	array to be filled by string from the port
+ *
+ *  returns:	int	number of chars in input array
+ *		INPUT_TRUNCATED	line did not fit, input holds its start
+ *		INPUT_PENDING	no line end yet
+ */
+int getInput(uint8_t port, char input[MAX_INPUT]){
+	int status;
+	uint8_t c;
+	
+	while(uart_available(port)){
+		c = uart_read(port);
+		
+		if(c == '\n' && uartSkipLf[port]){	//second half of CRLF
+			uartSkipLf[port] = 0;
+			continue;
+		}
+		uartSkipLf[port] = (c == '\r');
+		if(c == '\r' || c == '\n'){	//end of line
+			input[inputLen[port]] = '\0';
+			status = inputTruncated[port] ? INPUT_TRUNCATED : inputLen[port];
+			inputLen[port] = 0;
+			inputTruncated[port] = 0;
+			return status;
+		}
+		if(inputLen[port] < MAX_INPUT - 1){
+			input[inputLen[port]++] = c;
+		}
+		else{
+			inputTruncated[port] = 1;	//keep reading up to the line end
+		}
+	}
+	
+	return INPUT_PENDING;
+}
+
+/*
+ * Function:	task_uart
+ *  Scheduler task for the bytes received on one port. In text mode each 
+ *  finished line is checked, written to the port's panel and echoed, then 
+ *  the prompt is sent again. A line starting with a control char is run
+ *  as a command (see command_dispatch). A line starting with @n moves the
+ *  port to panel n first, and what follows may be a command for that 
+ *  panel. In terminal mode lines from every port go to the
+ *  history instead. A line with escape sequences is drawn at the text 
+ *  cursor (see vt_write). On USART0 a frame start byte at the beginning of
+ *  a line switches to binary frame mode. Returns once the port's receive 
+ *  ring buffer is empty.
+ *
+ *  port	uint8_t	USART number, 0 to UART_PORTS - 1
+ *  line	char[]	line being built by getInput for this port
+ *  LCDLine	int[]	LCD line the next string goes to, for each panel
+ *
+ *  returns:	1	LCD frame buffer changed
+ *		0	nothing to flush
+ */
+uint8_t task_uart(uint8_t port, char line[MAX_INPUT], int LCDLine[LCD_PANELS]){
+	uint8_t changed = 0;
+	uint8_t cmdStat;
+	int retStat;
+	int panelStat;
+	
+	uartOut = uart_stream(port);	//replies go back to this port
+	lcdPanel = uartPanel[port];	//and text to its panel
+	while(uart_available(port)){
+		if(port == 0 && frameMode){
+			changed |= frame_receive();
+			if(frameState != FRAME_RX_SOF){	//drop it if the rest is late
+				soft_timer_start(SOFT_TIMER_FRAME, FRAME_TIMEOUT_MS, 0);
+			}
+			else{
+				soft_timer_stop(SOFT_TIMER_FRAME);
+			}
+			if(!frameMode){		//FRAME_OP_TEXT was acknowledged
+				fputs_P(promptText, uartOut);
+			}
+			continue;
+		}
+		if(FRAME_ENABLED && port == 0 && inputLen[0] == 0 && !inputTruncated[0] 
+		   && uart_peek(0) == FRAME_SOF){
+			frameMode = 1;
+			continue;
+		}
+		
+		retStat = getInput(port, line);
+		if(retStat == INPUT_PENDING){
+			break;
+		}
+		statLinesIn++;
+		if(statLineState == STAT_LINE_IDLE){	//time the first line of a burst
+			statLineStart = micros();
+			statLineState = STAT_LINE_SEEN;
+		}
+		if(retStat > 0){		//@n picks the panel
+			panelStat = checkPanelSelect(line);
+			if(panelStat == PANEL_BAD){
+				fprintf_P(uartOut, PSTR("Error: panels are @0 to @%d\n\r"), LCD_PANELS - 1);
+			}
+			if(panelStat == PANEL_BAD || panelStat == 0){
+				fputs_P(promptText, uartOut);
+				continue;	//nothing to write
+			}
+			if(panelStat != PANEL_NONE){
+				retStat = panelStat;
+			}
+		}
+		//commands after @n run on that panel
+		cmdStat = command_dispatch(line, LCDLine);
+		if(cmdStat != CMD_TEXT){	//control char command, nothing to write
+			if(cmdStat == CMD_DRAW){
+				changed = 1;
+			}
+			fputs_P(promptText, uartOut);
+			continue;
+		}
+		if(termMode){			//every line goes to the history
+			term_add(line, retStat);
+			changed = 1;
+			fputs_P(promptText, uartOut);
+			continue;
+		}
+		if(textAtCursor[lcdPanel] || strchr(line, VT_ESC) != NULL){
+			textAtCursor[lcdPanel] = 0;	//drawn at the text cursor
+			vt_write(line, &LCDLine[lcdPanel]);
+			changed = 1;
+			fputs_P(promptText, uartOut);
+			continue;
+		}
+		//check line and output to screen and serial port
+		BENCH_MARK(BENCH_OP_OUTPUT_LINE);
+		outputLine(line, &LCDLine[lcdPanel], retStat);
+		BENCH_MARK(BENCH_OP_NONE);
+		textCol[lcdPanel] = 0;
+		changed = 1;
+		//prompt user
+		fputs_P(promptText, uartOut);
+	}
+	lcdShowAddr[lcdPanel] = LCD_ROW_START(LCDLine[lcdPanel]) + VT_SHOW_COL(textCol[lcdPanel]);
+	uartPanel[port] = lcdPanel;	//@n or a frame may have moved it
+	return changed;
+}
+
+/*
+ * Function:	checkPanelSelect
+ *  Checks input string for a panel prefix - @ and the panel number, then a
+ *  space or the end of the line, e.g. "@1 hello". A valid prefix selects 
+ *  the panel for this and later lines and is removed from the string.
+ *
+ *  input	char[]	string to be checked
+ *
+ *  returns:	int	chars left in input after the prefix (0 if the 
+ *			line only selected a panel)
+ *		PANEL_NONE	no prefix, input is unchanged
+ *		PANEL_BAD	prefix names a panel that is not fitted
+ */
+int checkPanelSelect(char input[MAX_INPUT]){
+	uint8_t panel;
+	
+	if(input[0] != '@' || input[1] < '0' || input[1] > '9'
+	   || (input[2] != ' ' && input[2] != '\0')){
+		return PANEL_NONE;
+	}
+	panel = input[1] - '0';
+	if(panel >= LCD_PANELS){
+		return PANEL_BAD;
+	}
+	lcdPanel = panel;
+	if(input[2] == '\0'){
+		input[0] = '\0';
+		return 0;
+	}
+	memmove(input, input + 3, strlen(input + 3) + 1);	//drop "@n "
+	return strlen(input);
+}
+
+/*
+ * Function:	command_dispatch
+ *  Runs the command for a line that starts with a control char. The char
+ *  indexes the command table, and up to CMD_MAX_ARGS numbers (0-255, 
+ *  separated by spaces, commas or semicolons) after it are passed to the
+ *  command. A command that takes no numbers only matches the char on its
+ *  own, so other lines are left as text like before.
+ *
+ *  input	char[]	line to be checked
+ *  LCDLine	int[]	LCD line the next string goes to, for each panel
+ *
+ *  returns:	CMD_TEXT	not a command, input is text
+ *		CMD_DONE	command ran (or its numbers were bad)
+ *		CMD_DRAW	command changed the frame buffer or cursor
+ */
+uint8_t command_dispatch(char input[MAX_INPUT], int LCDLine[LCD_PANELS]){
+	struct command cmd;
+	uint8_t argv[CMD_MAX_ARGS];
+	uint8_t argc = 0;
+	uint16_t value;
+	char* arg = input + 1;
+	
+	if((uint8_t)input[0] >= CMD_CHARS){
+		return CMD_TEXT;
+	}
+	memcpy_P(&cmd, &commands[(uint8_t)input[0]], sizeof(cmd));	//entry from flash
+	if(cmd.run == NULL || (cmd.maxArgs == 0 && *arg != '\0')){
+		return CMD_TEXT;
+	}
+	
+	while(*arg != '\0'){
+		if(*arg == ' ' || *arg == ',' || *arg == ';'){
+			arg++;
+			continue;
+		}
+		if(*arg < '0' || *arg > '9' || argc == cmd.maxArgs){
+			fprintf_P(uartOut, PSTR("Error: bad command arguments\n\r"));
+			return CMD_DONE;
+		}
+		value = 0;
+		while(*arg >= '0' && *arg <= '9' && value <= 255){
+			value = value * 10 + (*arg++ - '0');
+		}
+		if(value > 255){
+			fprintf_P(uartOut, PSTR("Error: bad command arguments\n\r"));
+			return CMD_DONE;
+		}
+		argv[argc++] = value;
+	}
+	return cmd.run(argc, argv, LCDLine);
+}
+
+/*
+ * Function:	cmd_backlight
+ *  Ctrl+B - turns the backlight off or back on, or with a number sets its
+ *  brightness (0 is off, 255 full).
+ *
+ *  argc	uint8_t		number of arguments
+ *  argv	uint8_t[]	[0] brightness
+ *  LCDLine	int[]		not used
+ *
+ *  returns:	CMD_DONE	nothing to draw
+ */
+uint8_t cmd_backlight(uint8_t argc, uint8_t argv[CMD_MAX_ARGS], int LCDLine[LCD_PANELS]){
+	if(argc != 0){
+		backlightLevel = argv[0];
+		backlightOn = backlightLevel != 0;	//as given, 0 is off
+	}
+	else{
+		backlightOn = !backlightOn;
+		if(backlightOn && backlightLevel == 0){	//turned on after "Ctrl+B 0"
+			backlightLevel = BACKLIGHT_DEFAULT;
+		}
+	}
+	hal_backlight_set(backlightOn ? backlightLevel : 0);
+	fprintf_P(uartOut, PSTR("Backlight %u\n\r"), backlightOn ? backlightLevel : 0);
+	return CMD_DONE;
+}
+
+/*
+ * Function:	cmd_clear
+ *  Ctrl+C or Ctrl+L - clears every line of the selected panel (the next 
+ *  line still goes where it would have). In terminal mode the history is
+ *  emptied instead.
+ *
+ *  argc	uint8_t		not used
+ *  argv	uint8_t[]	not used
+ *  LCDLine	int[]		not used
+ *
+ *  returns:	CMD_DRAW	frame buffer changed
+ */
+uint8_t cmd_clear(uint8_t argc, uint8_t argv[CMD_MAX_ARGS], int LCDLine[LCD_PANELS]){
+	if(termMode){
+		termCount = 0;
+		termBack = 0;
+		term_draw();
+		return CMD_DRAW;
+	}
+	for(int row = 0; row < LCD_ROWS; row++){
+		LCD_clear_line(&row);	//clear every line
+	}
+	return CMD_DRAW;
+}
+
+/*
+ * Function:	cmd_page_up
+ *  Ctrl+U - in terminal mode, moves the window a page up the history.
+ *
+ *  argc	uint8_t		not used
+ *  argv	uint8_t[]	not used
+ *  LCDLine	int[]		not used
+ *
+ *  returns:	CMD_DRAW	window moved
+ *		CMD_TEXT	not in terminal mode, the line is text
+ */
+uint8_t cmd_page_up(uint8_t argc, uint8_t argv[CMD_MAX_ARGS], int LCDLine[LCD_PANELS]){
+	uint8_t oldest = termCount > LCD_ROWS ? termCount - LCD_ROWS : 0;
+	
+	if(!termMode){
+		return CMD_TEXT;
+	}
+	termBack = termBack + LCD_ROWS < oldest ? termBack + LCD_ROWS : oldest;
+	term_draw();
+	return CMD_DRAW;
+}
+
+/*
+ * Function:	cmd_page_down
+ *  Ctrl+D - in terminal mode, moves the window a page down the history.
+ *
+ *  argc	uint8_t		not used
+ *  argv	uint8_t[]	not used
+ *  LCDLine	int[]		not used
+ *
+ *  returns:	CMD_DRAW	window moved
+ *		CMD_TEXT	not in terminal mode, the line is text
+ */
+uint8_t cmd_page_down(uint8_t argc, uint8_t argv[CMD_MAX_ARGS], int LCDLine[LCD_PANELS]){
+	if(!termMode){
+		return CMD_TEXT;
+	}
+	termBack = termBack > LCD_ROWS ? termBack - LCD_ROWS : 0;
+	term_draw();
+	return CMD_DRAW;
+}
+
+/*
+ * Function:	cmd_blink
+ *  Ctrl+E - turns the blinking cursor on the selected panel on or off. 
+ *  It blinks at the text cursor.
+ *
+ *  argc	uint8_t		not used
+ *  argv	uint8_t[]	not used
+ *  LCDLine	int[]		not used
+ *
+ *  returns:	CMD_DRAW	LCD cursor may need to move
+ */
+uint8_t cmd_blink(uint8_t argc, uint8_t argv[CMD_MAX_ARGS], int LCDLine[LCD_PANELS]){
+	lcd_display_ctrl(LCD_BLINK_ON, !(lcdDisplayCtrl[lcdPanel] & LCD_BLINK_ON));
+	return CMD_DRAW;
+}
+
+/*
+ * Function:	cmd_clear_line
+ *  Ctrl+K - clears the row the next line goes to, or the row given. The
+ *  text cursor moves to the start of the row.
+ *
+ *  argc	uint8_t		number of arguments
+ *  argv	uint8_t[]	[0] row, from 0
+ *  LCDLine	int[]		LCD line the next string goes to, for each panel
+ *
+ *  returns:	CMD_DRAW	frame buffer changed
+ *		CMD_DONE	no such row
+ */
+uint8_t cmd_clear_line(uint8_t argc, uint8_t argv[CMD_MAX_ARGS], int LCDLine[LCD_PANELS]){
+	if(argc != 0){
+		if(argv[0] >= LCD_ROWS){
+			fprintf_P(uartOut, PSTR("Error: rows are 0 to %d\n\r"), LCD_ROWS - 1);
+			return CMD_DONE;
+		}
+		LCDLine[lcdPanel] = argv[0];
+	}
+	LCD_clear_line(&LCDLine[lcdPanel]);
+	textCol[lcdPanel] = 0;
+	return CMD_DRAW;
+}
+
+/*
+ * Function:	cmd_display
+ *  Ctrl+O - turns the selected panel's display off or back on. DDRAM and
+ *  the frame buffer keep their contents while it is off.
+ *
+ *  argc	uint8_t		not used
+ *  argv	uint8_t[]	not used
+ *  LCDLine	int[]		not used
+ *
+ *  returns:	CMD_DONE	instruction queued, nothing to draw
+ */
+uint8_t cmd_display(uint8_t argc, uint8_t argv[CMD_MAX_ARGS], int LCDLine[LCD_PANELS]){
+	lcd_display_ctrl(LCD_DISPLAY_ON, !(lcdDisplayCtrl[lcdPanel] & LCD_DISPLAY_ON));
+	return CMD_DONE;
+}
+
+/*
+ * Function:	cmd_position
+ *  Ctrl+P - moves the text cursor of the selected panel to a row and 
+ *  column (both from 0, column 0 if left out). The next line is written 
+ *  there without clearing the row.
+ *
+ *  argc	uint8_t		number of arguments
+ *  argv	uint8_t[]	[0] row, [1] column
+ *  LCDLine	int[]		LCD line the next string goes to, for each panel
+ *
+ *  returns:	CMD_DRAW	cursor moved
+ *		CMD_DONE	position is off the screen
+ */
+uint8_t cmd_position(uint8_t argc, uint8_t argv[CMD_MAX_ARGS], int LCDLine[LCD_PANELS]){
+	if(argc == 0 || argv[0] >= LCD_ROWS || (argc == 2 && argv[1] >= LCD_COLS)){
+		fprintf_P(uartOut, PSTR("Error: position is row 0-%d, col 0-%d\n\r"), 
+			LCD_ROWS - 1, LCD_COLS - 1);
+		return CMD_DONE;
+	}
+	LCDLine[lcdPanel] = argv[0];
+	textCol[lcdPanel] = argc == 2 ? argv[1] : 0;
+	textAtCursor[lcdPanel] = 1;
+	return CMD_DRAW;
+}
+
+/*
+ * Function:	cmd_terminal
+ *  Ctrl+T - turns terminal mode on (on the selected panel) or off (the 
+ *  panel is blanked, the history is kept for next time). In terminal mode
+ *  Ctrl+U and Ctrl+D page the window up and down the history and Ctrl+C
+ *  empties it.
+ *
+ *  argc	uint8_t		not used
+ *  argv	uint8_t[]	not used
+ *  LCDLine	int[]		LCD line the next string goes to, for each panel
+ *
+ *  returns:	CMD_DRAW	panel changed
+ */
+uint8_t cmd_terminal(uint8_t argc, uint8_t argv[CMD_MAX_ARGS], int LCDLine[LCD_PANELS]){
+	termMode = !termMode;
+	if(termMode){
+		termPanel = lcdPanel;
+		termBack = 0;
+		term_draw();
+		fprintf_P(uartOut, PSTR("Terminal on - Ctrl+U/Ctrl+D page, Ctrl+T to leave\n\r"));
+	}
+	else{
+		soft_timer_stop(SOFT_TIMER_SCROLL);
+		term_home();
+		memset(lcdFrame[termPanel], ' ', sizeof(lcdFrame[termPanel]));
+		LCDLine[termPanel] = 0;
+		textCol[termPanel] = 0;
+		fprintf_P(uartOut, PSTR("Terminal off\n\r"));
+	}
+	return CMD_DRAW;
+}
+
+/*
+ * Function:	lcd_display_ctrl
+ *  Sets or clears display control bits (LCD_DISPLAY_ON, LCD_CURSOR_ON, 
+ *  LCD_BLINK_ON) on the selected panel and queues the instruction.
+ *
+ *  bits	uint8_t	bits to change
+ *  on		uint8_t	1 sets them, 0 clears them
+ *
+ *  returns:	none
+ */
+void lcd_display_ctrl(uint8_t bits, uint8_t on){
+	if(on){
+		lcdDisplayCtrl[lcdPanel] |= bits;
+	}
+	else{
+		lcdDisplayCtrl[lcdPanel] &= ~bits;
+	}
+	LCD_write_instruction(lcdPanel, lcdDisplayCtrl[lcdPanel]);
+	return;
+}
+
+/*
+ * Function:	vt_write
+ *  Draws a line at the text cursor of the selected panel without clearing
+ *  the row first. Escape sequences in the line are run where they appear
+ *  (see vt_escape), and other control chars are dropped. The text cursor
+ *  and LCDLine are left after the last char, so the next escape sequence 
+ *  line carries on from there. As on a VT100, a char written in the last
+ *  column leaves the cursor past it (textCol is LCD_COLS), and the wrap to
+ *  the next row only happens when another char is written.
+ *
+ *  input	char[]	line to be drawn
+ *  LCDLine	int*	row of the text cursor
+ *
+ *  returns:	none
+ */
+void vt_write(char input[MAX_INPUT], int* LCDLine){
+	int row = *LCDLine;
+	int col = textCol[lcdPanel];
+	int i = 0;
+	
+	while(input[i] != '\0'){
+		if(input[i] == VT_ESC){
+			i = vt_escape(input, i + 1, &row, &col);
+			continue;
+		}
+		if((uint8_t)input[i] >= ' '){
+			if(col >= LCD_COLS){	//wrap to the next row
+				col = 0;
+				row = LCD_NEXT_ROW(row);
+			}
+			lcdFrame[lcdPanel][row][col++] = input[i];
+		}
+		i++;
+	}
+	*LCDLine = row;
+	textCol[lcdPanel] = col;		//LCD_COLS if a wrap is pending
+	return;
+}
+
+/*
+ * Function:	vt_escape
+ *  Runs one escape sequence from a line, starting after the ESC. The VT100
+ *  subset is:
+ *    ESC [ r ; c H	cursor to row r, column c (from 1, default 1), also f
+ *    ESC [ n A/B/C/D	cursor up/down/right/left n (default 1)
+ *    ESC [ n J		erase to the end (0), from the start (1) or all (2)
+ *    ESC [ n K		erase the row to the end (0), from the start (1) or 
+ *			all of it (2)
+ *    ESC [ ? 25 h/l	show/hide the underline cursor
+ *    ESC c		reset - clear the panel and home the cursor
+ *  Other sequences are skipped. The final char picks the action through a
+ *  switch, which the compiler turns into a jump table. The cursor moves and
+ *  erases drop a pending wrap first, so they start from the last column.
+ *
+ *  input	char[]	line holding the sequence
+ *  i		int	index of the char after the ESC
+ *  row		int*	text cursor row, moved by the sequence
+ *  col		int*	text cursor column, moved by the sequence
+ *
+ *  returns:	int	index of the first char after the sequence
+ */
+int vt_escape(char input[MAX_INPUT], int i, int* row, int* col){
+	uint8_t param[VT_MAX_PARAMS] = {0, 0};
+	uint8_t count = 0;
+	uint8_t privateMode = 0;
+	char final;
+	
+	if(input[i] == 'c'){			//reset
+		memset(lcdFrame[lcdPanel], ' ', sizeof(lcdFrame[lcdPanel]));
+		*row = 0;
+		*col = 0;
+		return i + 1;
+	}
+	if(input[i] != '['){			//not a CSI sequence, skip one char
+		return input[i] != '\0' ? i + 1 : i;
+	}
+	i++;
+	if(input[i] == '?'){
+		privateMode = 1;
+		i++;
+	}
+	//parameters are decimal numbers split by ';', up to the final char
+	while(input[i] != '\0' && (input[i] < 0x40 || input[i] > 0x7E)){
+		if(input[i] == ';'){
+			if(count < VT_MAX_PARAMS){
+				count++;
+			}
+		}
+		else if(input[i] >= '0' && input[i] <= '9' && count < VT_MAX_PARAMS){
+			param[count] = param[count] * 10 + (input[i] - '0');
+		}
+		i++;
+	}
+	final = input[i];
+	if(final == '\0'){
+		return i;			//line ended inside the sequence
+	}
+	
+	if(privateMode){
+		if(param[0] == 25 && (final == 'h' || final == 'l')){
+			lcd_display_ctrl(LCD_CURSOR_ON, final == 'h');
+		}
+		return i + 1;
+	}
+	if(strchr_P(PSTR("HfABCDJK"), final) == NULL){
+		return i + 1;			//not in the subset, a pending wrap stays
+	}
+	if(*col >= LCD_COLS){			//wrap pending
+		*col = LCD_COLS - 1;
+	}
+	switch(final){
+	case 'H':
+	case 'f':
+		*row = param[0] > 1 ? param[0] - 1 : 0;
+		*col = param[1] > 1 ? param[1] - 1 : 0;
+		break;
+	case 'A':
+		*row -= param[0] ? param[0] : 1;
+		break;
+	case 'B':
+		*row += param[0] ? param[0] : 1;
+		break;
+	case 'C':
+		*col += param[0] ? param[0] : 1;
+		break;
+	case 'D':
+		*col -= param[0] ? param[0] : 1;
+		break;
+	case 'J':
+		if(param[0] == 0){		//cursor to the end of the panel
+			vt_erase(*row, *col, LCD_COLS);
+			for(int r = *row + 1; r < LCD_ROWS; r++){
+				vt_erase(r, 0, LCD_COLS);
+			}
+		}
+		else if(param[0] == 1){		//start of the panel to the cursor
+			for(int r = 0; r < *row; r++){
+				vt_erase(r, 0, LCD_COLS);
+			}
+			vt_erase(*row, 0, *col + 1);
+		}
+		else if(param[0] == 2){
+			memset(lcdFrame[lcdPanel], ' ', sizeof(lcdFrame[lcdPanel]));
+		}
+		break;
+	case 'K':
+		if(param[0] == 0){
+			vt_erase(*row, *col, LCD_COLS);
+		}
+		else if(param[0] == 1){
+			vt_erase(*row, 0, *col + 1);
+		}
+		else if(param[0] == 2){
+			vt_erase(*row, 0, LCD_COLS);
+		}
+		break;
+	}
+	//keep the cursor on the screen
+	*row = *row < 0 ? 0 : (*row >= LCD_ROWS ? LCD_ROWS - 1 : *row);
+	*col = *col < 0 ? 0 : (*col >= LCD_COLS ? LCD_COLS - 1 : *col);
+	return i + 1;
 }
 
 /*
- * Function:	LCD_clear_line
- *  Clears a line of the LCD screen based on the input pointer, then corrects 
- *  the value the pointer is pointing at to be the line that was cleared.
+ * Function:	vt_erase
+ *  Fills part of a row of the selected panel with spaces.
  *
- *  line	int*	LCD screen line to be cleared
+ *  row		int	row to erase
+ *  from	int	first column
+ *  to		int	column after the last one
  *
- *  returns:  none
+ *  returns:	none
  */
-void LCD_clear_line(int* line){
-	LCD_write_str("                ", line);	//write clear line to LCD
-	*line ^= 0x01;					//go to line that was cleared
+void vt_erase(int row, int from, int to){
+	if(to > from){
+		memset(&lcdFrame[lcdPanel][row][from], ' ', to - from);
+	}
 	return;
 }
-/*
- * Function:  InitTimer0
- *  Sets up timer0 to output a PWM signal to the OC0B port (G5) with the
- *  following settings:	8-bit phase corrected PWM
- *                      non inverted
- *                    	256 prescaler
- *
- *  returns:  none
- */
 
 /*
- * Function:	initializeTimers
- *  Sets up timer0 to run with a 256 prescaler and enables timer 0 overflow
- *  interrupt.
+ * Function:	term_add
+ *  Adds a line to the terminal history and shows it. A line longer than
+ *  TERM_LINE_LEN is split over as many history lines as it needs, and the
+ *  oldest lines are overwritten once the ring is full. A window that was 
+ *  paged up stays on the lines it shows.
  *
- *  returns:	none
- */
-void initializeTimers(){
-   	TCCR0A = 0x00;
-   	TCCR0B |= (1<<CS12); 	//turn timer0 on with 256 prescaler
- 
-   	sei();    		//Enable global interrupts by setting global interrupt enable
-                		//bit in SREG
-   	
-   	TIMSK0 = (1 << TOIE0);	//enable timer0 overflow interrupt(TOIE0)
-   	TCNT0 = 65536 - 1;	//timer0 overflow in one clock cycle
-   	
-   	return;
-}
-
-/*
- * Function:	InitUSART0
- *  Sets up USART0 to use a baudrate equal to the global constant 
- *  USART_BAUDRATE, and use 8 bit character frames and async mode.
+ *  input	char[]	string to be added
+ *  returnStatus	int	number of chars in input string or 
+ *				INPUT_TRUNCATED (the start is added)
  *
  *  returns:	none
  */
-void InitUSART0(){
-	UCSR0B |= 0x18;	//Enable RX and TX
-	UCSR0C |= 0x06;	//Use 8 bit character frames in async mode
+void term_add(char input[MAX_INPUT], int returnStatus){
+	int len = strlen(input);
+	int start = 0;
+	
+	do{
+		termNewest = (termNewest + 1) % TERM_LINES;
+		strncpy(termHistory[termNewest], input + start, TERM_LINE_LEN);
+		termHistory[termNewest][TERM_LINE_LEN] = '\0';
+		if(termCount < TERM_LINES){
+			termCount++;
+		}
+		if(termBack != 0 && termBack + LCD_ROWS < termCount){
+			termBack++;		//keep the window on its lines
+		}
+		start += TERM_LINE_LEN;
+	}while(start < len);
 	
-	//set baud rate (upper 4 bits should be zero)
-	UBRR0L = BAUD_PRESCALE;
-	UBRR0H = (BAUD_PRESCALE >> 8);
+	term_draw();
+	if(returnStatus == INPUT_TRUNCATED){
+		fprintf_P(uartOut, PSTR("Your str is: %s (cut to %d chars)\n\r"), input, len);
+	}
+	else{
+		fprintf_P(uartOut, echoText, input);
+	}
 	return;
 }
 
 /*
- * Function:	uart_putchar0
- *  Function to send chars to USART0. Used to setup USART0_OUT as a file
- *  pointer to the serial port so that data can be sent there.
+ * Function:	term_line
+ *  Finds the history line shown on a row of the terminal window. The bottom
+ *  row has the newest line, or the line termBack lines above it.
  *
- *  c		char	character to be transmitted through the serial line
- *  stream	FILE*	pointer for USART0 output
+ *  row		uint8_t	window row, 0 to LCD_ROWS - 1
  *
- *  returns:	0	successful function run
+ *  returns:	char*	history line
+ *		NULL	the history does not reach this row
  */
-int uart_putchar0(char c, FILE* stream){
-	if(c == '\n') uart_putchar0('\r', stream);	//change newlines to return 
-							//carriage
-	loop_until_bit_is_set(UCSR0A, UDRE0);		//wait until transmitter is 
-							//ready for new data
-	UDR0 = c;					//transmit next character
-	return 0;
+char* term_line(uint8_t row){
+	uint8_t back = termBack + LCD_ROWS - 1 - row;	//lines above the newest
+	
+	if(back >= termCount){
+		return NULL;
+	}
+	return termHistory[(termNewest + TERM_LINES - back) % TERM_LINES];
 }
 
 /*
- * Function:	uart_getchar0
- *  Function to get chars from USART0. Used to setup USART0_IN as a file 
- *  pointer to the serial port so that data can be received from USART0.
+ * Function:	term_draw
+ *  Draws the terminal window after the history or the window moved. The 
+ *  sideways scroll starts again from the left, and its timer only runs 
+ *  while a line in the window is wider than the LCD.
  *
- *  returns:	int	value recieved from serial communication port, USART0
+ *  returns:	none
  */
-int uart_getchar0(void){
-	uint8_t temp;
-	while(!(UCSR0A & (1 << RXC0)));	//wait for serial value to enter UDR
-	temp = UDR0;			//get value from UDR and return it
-	return temp;
+void term_draw(void){
+	uint8_t longest = 0;
+	char* text;
+	
+	for(uint8_t row = 0; row < LCD_ROWS; row++){
+		text = term_line(row);
+		if(text != NULL && strlen(text) > longest){
+			longest = strlen(text);
+		}
+	}
+	term_home();
+	termScrollMax = longest > LCD_COLS ? longest - LCD_COLS : 0;
+	termScrollHold = TERM_SCROLL_HOLD;
+	if(termScrollMax != 0){
+		soft_timer_start(SOFT_TIMER_SCROLL, TERM_SCROLL_MS, TERM_SCROLL_MS);
+	}
+	else{
+		soft_timer_stop(SOFT_TIMER_SCROLL);
+	}
+	term_render();
+	return;
 }
 
-
 /*
- * Function:	getInput0
- *  Gets line from USART0 and stores in input array, then returns the number
- *  of characters stored in the input array.
+ * Function:	term_render
+ *  Writes the terminal window to the frame buffer of the terminal panel. 
+ *  With TERM_HW_SHIFT the whole line goes into the row's DDRAM line and 
+ *  the display shift shows the part past LCD_COLS. Otherwise the row is 
+ *  redrawn from termScroll columns into the line.
  *
- *  input	char[]	array to be filled by string from USART0
- *
- *  returns:	int	number of chars in input array
+ *  returns:	none
  */
-int getInput0(char input[MAX_INPUT]){
-	int inputVal;
-	inputVal = fscanf(&USART0_IN, "%[^\r]s ", input);	//get input line
-	fgetc(&USART0_IN);					//clear input buffer
+void term_render(void){
+	char* text;
+	uint8_t len;
 	
-	return inputVal;
+	for(uint8_t row = 0; row < LCD_ROWS; row++){
+		memset(lcdFrame[termPanel][row], ' ', LCD_ROW_CELLS);
+		text = term_line(row);
+		if(text == NULL){
+			continue;
+		}
+		len = strlen(text);
+#if TERM_HW_SHIFT
+		memcpy(lcdFrame[termPanel][row], text, len);
+#else
+		if(len > termScroll){
+			len -= termScroll;
+			memcpy(lcdFrame[termPanel][row], text + termScroll,
+			       len < LCD_COLS ? len : LCD_COLS);
+		}
+#endif
+	}
+	return;
 }
 
 /*
- * Function:	checkInput
- *  Checks input string to see if Ctrl+C was pressed or if input is too long.
- *  Returns a status value depending on if either of these are true
+ * Function:	term_home
+ *  Scrolls the terminal window back to the start of its lines. With 
+ *  TERM_HW_SHIFT this queues a return home, which also moves the LCD 
+ *  cursor to 0x00.
  *
- *  input	char[]	string to be checked
+ *  returns:	none
+ */
+void term_home(void){
+#if TERM_HW_SHIFT
+	if(termScroll != 0){
+		LCD_write_instruction(termPanel, LCD_4bit_returnHOME);
+		lcdCursorAddr[termPanel] = LCD_ROW_START(0);
+	}
+#endif
+	termScroll = 0;
+	return;
+}
+
+/*
+ * Function:	term_scroll
+ *  Scheduler task for the sideways scroll, run every TERM_SCROLL_MS. Moves
+ *  the window one column left until the end of the longest line is on the
+ *  LCD, waits TERM_SCROLL_HOLD steps, then jumps back to the start and 
+ *  waits again. A step with TERM_HW_SHIFT is a single display shift 
+ *  instruction, DDRAM is not written.
  *
- *  returns:	0	status is normal
- *		1	status is clear screen (Ctrl+C is entered)
- *		2	status is input line is too long
+ *  returns:	1	LCD frame buffer changed
+ *		0	nothing to flush
  */
-int checkInput(char input[MAX_INPUT]){
-	int status = 0;
-	
-	status = checkClearInput(input);//check if Ctrl+C is entered
-	if(status != 0){		//return 1 if true
-		return status;
+uint8_t term_scroll(void){
+	if(!termMode || termScrollMax == 0){
+		return 0;
+	}
+	if(termScrollHold != 0){
+		termScrollHold--;
+		return 0;
 	}
 	
-	status = checkInputLen(input);	//check if input line is too long
-					//set status to 2 if true
-	
-	return status;			//return status;
+	if(termScroll == termScrollMax){	//end is showing, back to the start
+		term_home();
+		termScrollHold = TERM_SCROLL_HOLD;
+	}
+	else{
+		termScroll++;
+#if TERM_HW_SHIFT
+		LCD_write_instruction(termPanel, LCD_4bit_shiftLEFT);
+#endif
+		if(termScroll == termScrollMax){
+			termScrollHold = TERM_SCROLL_HOLD;
+		}
+	}
+#if TERM_HW_SHIFT
+	return 0;
+#else
+	term_render();
+	return 1;
+#endif
 }
 
 /*
- * Function:	checkClearInput
- *  Checks input string. If input string contains only Ctrl+C, then the LCD 
- *  screen is cleared. A status value is returned.
+ * Function:	cmd_report
+ *  Ctrl+R - sends back the run time statistics, four lines:
+ *    in	lines received, lines too long, receive ring overflows, data 
+ *		overruns and framing errors (all ports)
+ *    uN	the loss counters of port N, only with UART_PORTS above 1
+ *    lcd	bytes written, clears, chars streamed, their bus time in us,
+ *		chars per second and snapshot records saved
+ *    line	line end to last LCD write, in us (see stat_print)
+ *    loop	main loop pass from wake to sleep, in us
  *
- *  input	char[]	string to be checked
+ *  argc	uint8_t		not used
+ *  argv	uint8_t[]	not used
+ *  LCDLine	int[]		not used
  *
- *  returns:	0	screen was not cleared (Ctrl+C is not entered)
- *		1	screen is cleared (Ctrl+C is entered)
+ *  returns:	CMD_DONE	nothing to draw
  */
-int checkClearInput(char input[MAX_INPUT]){
-	int temp = 0;
+uint8_t cmd_report(uint8_t argc, uint8_t argv[CMD_MAX_ARGS], int LCDLine[LCD_PANELS]){
+	uint32_t writes, chars, us;
+	uint16_t clears, snaps, overflows[UART_PORTS], overruns[UART_PORTS], frameErrors[UART_PORTS];
+	uint16_t overflowSum = 0, overrunSum = 0, frameErrorSum = 0, stops;
+	struct stat_hist line;
+	
+	cli();				//take a consistent copy from the ISRs
+	writes = statLcdWrites;
+	clears = statLcdClears;
+	snaps = statSnapshots;
+	chars = lcdStreamChars;
+	us = lcdStreamTicks * LCD_TICK_US;
+	memcpy(overflows, (const void*)uartRxOverflows, sizeof(overflows));
+	memcpy(overruns, (const void*)uartRxOverruns, sizeof(overruns));
+	memcpy(frameErrors, (const void*)uartRxFrameErrors, sizeof(frameErrors));
+	stops = uartFlowStops;
+	line = statLineLcd;
+	sei();
 	
-	if(strcmp(input, "\x03") == 0){	//if Ctrl+C is entered, clear the screen
-		LCD_clear_line(&temp);	//clear line 1
-		temp = 1;
-		LCD_clear_line(&temp);	//clear line 2
-		return 1;		//return clear line status
+	for(uint8_t port = 0; port < UART_PORTS; port++){
+		overflowSum += overflows[port];
+		overrunSum += overruns[port];
+		frameErrorSum += frameErrors[port];
 	}
-	return 0;			//Ctrl+C was not entered
+	fprintf_P(uartOut, PSTR("in lines=%u long=%u ovf=%u dor=%u fe=%u stops=%u\n\r"),
+		statLinesIn, statLinesLong, overflowSum, overrunSum, frameErrorSum, stops);
+#if UART_PORTS > 1
+	for(uint8_t port = 0; port < UART_PORTS; port++){
+		fprintf_P(uartOut, PSTR("u%u ovf=%u dor=%u fe=%u\n\r"), port, overflows[port],
+			overruns[port], frameErrors[port]);
+	}
+#endif
+	fprintf_P(uartOut, PSTR("lcd writes=%lu clears=%u stream=%lu us=%lu cps=%lu snaps=%u\n\r"),
+		(unsigned long)writes, clears, (unsigned long)chars, (unsigned long)us,
+		us ? (unsigned long)(chars * 1000000ULL / us) : 0UL, snaps);
+	stat_print(PSTR("line"), &line);
+	stat_print(PSTR("loop"), &statLoop);
+	return CMD_DONE;
 }
 
 /*
  * Function:	checkInputLen
- *  Checks input string. If input string is too long to be outputted to both 
+ *  Checks input string. If input string is too long to be outputted to all 
  *  lines of the LCD screen, 2 is returned, else 0 is returned
  *
  *  input	char[]	string to be checked
@@ -497,12 +2978,12 @@ int checkClearInput(char input[MAX_INPUT]){
  *		2	string will not fit on LCD screen
  */
 int checkInputLen(char input[MAX_INPUT]){
-	for(int i = 0; i < 33; i++){	//for loop to check for end of string
+	for(int i = 0; i <= LCD_CELLS; i++){	//for loop to check for end of string
 		if(input[i] == '\0'){	//if end of string is encountered, return 0
 			return 0;
 		}
 	}
-	//if string is longer than two lines of the LCD screen, return 2
+	//if string is longer than every line of the LCD screen, return 2
 	return 2;
 }
 
@@ -510,8 +2991,9 @@ int checkInputLen(char input[MAX_INPUT]){
  * Function:	outputLine
  *  Check the status of the input line and output accordingly. If status is 0
  *  (normal status), write the input string to the input line of the LCD 
- *  screen. If status is 1 (clear screen), output nothing. If status is 2 
- *  (string is too long), then output an error message. Also checks if return
+ *  screen. If status is 2 (string is too long), then output an error 
+ *  message. Control char commands never get here, command_dispatch runs 
+ *  them first. Also checks if return
  *  was pressed without any other input (input string is empty) and changes the
  *  LCD line without clearing if true.
  *
@@ -520,7 +3002,7 @@ int checkInputLen(char input[MAX_INPUT]){
  *		(will wrap to the other line if too long for one 
  *		line)
  *  returnStatus	int	number of chars in input string (without null 
- *				terminator)
+ *				terminator) or INPUT_TRUNCATED
  *
  *  returns:	none
  */
@@ -533,15 +3015,22 @@ void outputLine(char input[MAX_INPUT], int* LCDLine, int returnStatus){
 		return;			//return from function
 	}
 	
-	status = checkInput(input);	//get the ststus of the input string
+	if(returnStatus == INPUT_TRUNCATED){	//line overflowed the input buffer
+		statLinesLong++;
+		printErr(LCDLine);
+		return;
+	}
+	
+	status = checkInputLen(input);	//check if the input string is too long
 	
 	if(status == 0){		//if string is normal, output to LCD
 		LCD_clear_line(LCDLine);	//clear LCD line and write string to line
 		LCD_write_str(input, LCDLine);
 		//return input line to USART0
-		fprintf(&USART0_OUT, "Your str is: %s \n\r", input);
+		fprintf_P(uartOut, echoText, input);
 	}
 	if(status == 2){		//if string is too long, print error message
+		statLinesLong++;
 		printErr(LCDLine);	//print error message and set LCDline to 0
 	}
 	return;
@@ -549,23 +3038,21 @@ void outputLine(char input[MAX_INPUT], int* LCDLine, int returnStatus){
 
 /*
  * Function:	printErr
- *  Write error message to LCD screen and set LCDLine to 0
+ *  Write error message to LCD screen and set LCDLine to 0. The message 
+ *  strings are read straight from flash. Also used for hard coded strings.
  *
  *  LCDLine	int*	line of the LCD screen to write the string to
  *
  *  returns:	none
  */
 void printErr(int* LCDLine){
-	char errMsg[MAX_INPUT] = "Error:";
-	
 	*LCDLine = 0;			//write to LCD line 1
 	LCD_clear_line(LCDLine);	//clear line
-	LCD_write_str(errMsg, LCDLine);	//print top half of error message
+	LCD_write_str_P(PSTR("Error:"), LCDLine);	//print top half of error message
 	
-	strcpy(errMsg, "Line Too Long");
 	*LCDLine = 1;			//write to LCD line 2
 	LCD_clear_line(LCDLine);	//clear line
-	LCD_write_str(errMsg, LCDLine);	//write bottom half of error message
+	LCD_write_str_P(PSTR("Line Too Long"), LCDLine);	//write bottom half of error message
 	
 	return;
 }
@@ -574,9 +3061,8 @@ void printErr(int* LCDLine){
  * Function:	outputHardLine
  *  Prints hard coded string to LCD screen. Checks the status of the input 
  *  line and output accordingly. If status is 0 (normal status), write the
- *  input string to the input line of the LCD screen. If status is 1 (clear 
- *  screen), output nothing. If status is 2 (string is too long), then output 
- *  an error message.
+ *  input string to the input line of the LCD screen. If status is 2 (string
+ *  is too long), then output an error message.
  *
  *  input	char[]	string to be written to the LCD screen
  *
@@ -586,7 +3072,7 @@ void outputHardLine(char input[MAX_INPUT]){
 	int status = 0;
 	int LCDLine = 0;		//write to line 1 of LCD screen
 	
-	status = checkInput(input);	//check input string
+	status = checkInputLen(input);	//check input string
 	
 	//if status is 0, clear the first line of the LCD screen and write input
 	//line to LCD screen. String is wrapped if it is too long for one line 
@@ -596,48 +3082,604 @@ void outputHardLine(char input[MAX_INPUT]){
 	}
 	//if status is 2 (line is too long), write error message to LCD screen
 	if(status == 2){
-		printHardErr();
+		printErr(&LCDLine);
 	}
+	LCD_flush();			//send changed cells to the LCD
 	return;
 }
 
 /*
- * Function:	printHardErr
- *  Write error message to LCD screen. Used for hard coded strings
+ * Function:	outputHardChars
+ *  Write a single char to each line of the LCD screen
+ *
+ *  char1	char	char to be written to first line
+ *  char2	char	char to be written to second line
  *
  *  returns:	none
  */
-void printHardErr(){
-	char errMsg[MAX_INPUT] = "Error:";
-	int LCDLine = 0;			//set line to 1
-	LCD_clear_line(&LCDLine);		//clear line
-	LCD_write_str(errMsg, &LCDLine);	//write first half of error message
+void outputHardChars(char char1, char char2){
+	//  Write a single character  //
+	// line one	 //
+	lcdFrame[lcdPanel][0][0] = char1;
 	
-	strcpy(errMsg, "Line Too Long");
-	LCDLine = 1;				//set line to 2
-	LCD_clear_line(&LCDLine);		//clear line
-	LCD_write_str(errMsg, &LCDLine);	//write second half of error message
+	// line two  //
+	lcdFrame[lcdPanel][1][0] = char2;
 	
+	LCD_flush();			//send changed cells to the LCD
 	return;
 }
 
 /*
- * Function:	outputHardChars
- *  Write a single char to each line of the LCD screen
+ * Function:	crc16_update
+ *  Adds one byte to a CRC-16/CCITT (polynomial 0x1021, MSB first). Start
+ *  with 0xFFFF.
  *
- *  char1	char	char to be written to first line
- *  char2	char	char to be written to second line
+ *  crc		uint16_t	CRC so far
+ *  data	uint8_t		next byte
+ *
+ *  returns:	uint16_t	updated CRC
+ */
+uint16_t crc16_update(uint16_t crc, uint8_t data){
+	crc ^= (uint16_t)data << 8;
+	for(uint8_t i = 0; i < 8; i++){
+		if(crc & 0x8000){
+			crc = (crc << 1) ^ 0x1021;
+		}
+		else{
+			crc <<= 1;
+		}
+	}
+	return crc;
+}
+
+/*
+ * Function:	frame_receive
+ *  Feeds the bytes waiting in the USART0 receive ring buffer through the 
+ *  frame reader. When a frame is complete it is run and answered with an 
+ *  ACK or NAK frame carrying its sequence number, and the function returns
+ *  so the caller can see a switch back to text mode. Bytes before the start
+ *  of frame byte are thrown away, so the reader falls back into step after
+ *  a corrupt frame. The LCD frame buffer is changed but not flushed.
+ *
+ *  returns:	1	a frame was applied to the LCD frame buffer
+ *		0	no complete frame, or it was NAKed
+ */
+uint8_t frame_receive(void){
+	uint8_t c, err;
+	
+	while(uart_available(0)){
+		c = uart_read(0);
+		switch(frameState){
+		case FRAME_RX_SOF:		//hunt for the start of a frame
+			if(c == FRAME_SOF){
+				frameCrc = 0xFFFF;
+				frameState = FRAME_RX_LEN;
+			}
+			continue;
+		case FRAME_RX_LEN:
+			frameLen = c;
+			frameState = FRAME_RX_SEQ;
+			break;
+		case FRAME_RX_SEQ:
+			frameSeq = c;
+			frameState = FRAME_RX_OP;
+			if(frameLen > FRAME_MAX_PAYLOAD){	//too long to hold, resync
+				err = FRAME_ERR_LEN;
+				frame_send(frameSeq, FRAME_OP_NAK, &err, 1);
+				frameState = FRAME_RX_SOF;
+				return 0;
+			}
+			break;
+		case FRAME_RX_OP:
+			frameOp = c;
+			frameIndex = 0;
+			frameState = frameLen ? FRAME_RX_PAYLOAD : FRAME_RX_CRC_HI;
+			break;
+		case FRAME_RX_PAYLOAD:
+			framePayload[frameIndex++] = c;
+			if(frameIndex == frameLen){
+				frameState = FRAME_RX_CRC_HI;
+			}
+			break;
+		case FRAME_RX_CRC_HI:
+			frameCrc ^= (uint16_t)c << 8;	//zero once both bytes match
+			frameState = FRAME_RX_CRC_LO;
+			continue;
+		case FRAME_RX_CRC_LO:
+			frameCrc ^= c;
+			frameState = FRAME_RX_SOF;
+			if(frameCrc != 0){
+				err = FRAME_ERR_CRC;
+			}
+			else{
+				err = frame_execute(frameOp, framePayload, frameLen);
+			}
+			if(err != 0){
+				frame_send(frameSeq, FRAME_OP_NAK, &err, 1);
+				return 0;
+			}
+			frame_send(frameSeq, FRAME_OP_ACK, NULL, 0);
+			return 1;
+		}
+		frameCrc = crc16_update(frameCrc, c);	//LEN to the end of the payload
+	}
+	return 0;
+}
+
+/*
+ * Function:	frame_execute
+ *  Applies a received frame to the selected panel's LCD frame buffer. A 
+ *  frame that fails its checks changes nothing, including a batch with 
+ *  one bad record.
+ *
+ *  op		uint8_t		FRAME_OP_* opcode
+ *  payload	uint8_t*	frame payload
+ *  len		uint8_t		payload length
+ *
+ *  returns:	0		frame was applied
+ *		FRAME_ERR_*	reason for the NAK
+ */
+uint8_t frame_execute(uint8_t op, uint8_t* payload, uint8_t len){
+	switch(op){
+	case FRAME_OP_WRITE_AT:
+		if(len < 2){
+			return FRAME_ERR_ARGS;
+		}
+		return frame_write_cells(payload[0], payload[1], payload + 2, len - 2);
+	
+	case FRAME_OP_CLEAR:
+		memset(lcdFrame[lcdPanel], ' ', sizeof(lcdFrame[lcdPanel]));
+		frameRow = 0;
+		frameCol = 0;
+		return 0;
+	
+	case FRAME_OP_SET_CURSOR:
+		if(len != 2 || payload[0] >= LCD_ROWS || payload[1] >= LCD_COLS){
+			return FRAME_ERR_ARGS;
+		}
+		frameRow = payload[0];
+		frameCol = payload[1];
+		return 0;
+	
+	case FRAME_OP_WRITE:
+		for(uint8_t i = 0; i < len; i++){
+			lcdFrame[lcdPanel][frameRow][frameCol] = payload[i];
+			if(++frameCol == LCD_COLS){	//wrap to the next row
+				frameCol = 0;
+				frameRow = (frameRow + 1) % LCD_ROWS;
+			}
+		}
+		return 0;
+	
+	case FRAME_OP_BATCH:
+		//first pass checks every record, second pass writes them
+		for(uint8_t apply = 0; apply < 2; apply++){
+			for(uint8_t i = 0; i < len; i += 3 + payload[i + 2]){
+				if(len - i < 3 || payload[i + 2] > len - i - 3
+				   || payload[i] >= LCD_ROWS || payload[i + 1] >= LCD_COLS){
+					return FRAME_ERR_ARGS;
+				}
+				if(apply){
+					frame_write_cells(payload[i], payload[i + 1], 
+							  payload + i + 3, payload[i + 2]);
+				}
+			}
+		}
+		return 0;
+	
+	case FRAME_OP_TEXT:
+		frameMode = 0;			//prompt comes back after the ACK
+		return 0;
+	
+	case FRAME_OP_PANEL:
+		if(len != 1 || payload[0] >= LCD_PANELS){
+			return FRAME_ERR_ARGS;
+		}
+		lcdPanel = payload[0];
+		return 0;
+	
+	case FRAME_OP_GLYPH:
+		if(len != 9 || payload[0] < GLYPH_USER_FIRST || payload[0] >= GLYPH_IDS){
+			return FRAME_ERR_ARGS;
+		}
+		glyph_define(payload[0], payload + 1);
+		return 0;
+	
+	case FRAME_OP_GLYPH_AT:
+		if(len != 3 || payload[0] >= LCD_ROWS || payload[1] >= LCD_COLS
+		   || payload[2] >= GLYPH_IDS){
+			return FRAME_ERR_ARGS;
+		}
+		lcdFrame[lcdPanel][payload[0]][payload[1]] = glyph_use(lcdPanel, payload[2]);
+		return 0;
+	
+	case FRAME_OP_BAR:
+		if(len != 5 || payload[0] >= LCD_ROWS || payload[1] >= LCD_COLS
+		   || payload[4] == 0){
+			return FRAME_ERR_ARGS;
+		}
+		widget_bar(payload[0], payload[1], payload[2], payload[3], payload[4]);
+		return 0;
+	
+	case FRAME_OP_SPARK:
+		if(len < 3 || payload[0] >= LCD_ROWS || payload[1] >= LCD_COLS
+		   || payload[2] == 0){
+			return FRAME_ERR_ARGS;
+		}
+		widget_sparkline(payload[0], payload[1], payload + 3, len - 3, payload[2]);
+		return 0;
+	
+	default:
+		return FRAME_ERR_OP;
+	}
+}
+
+/*
+ * Function:	frame_write_cells
+ *  Copies chars into one row of the LCD frame buffer starting at col. Chars
+ *  past the end of the row are dropped.
+ *
+ *  row		uint8_t		LCD row
+ *  col		uint8_t		first column
+ *  chars	uint8_t*	chars to write
+ *  count	uint8_t		number of chars
+ *
+ *  returns:	0		chars were written
+ *		FRAME_ERR_ARGS	row or col is off the screen
+ */
+uint8_t frame_write_cells(uint8_t row, uint8_t col, uint8_t* chars, uint8_t count){
+	if(row >= LCD_ROWS || col >= LCD_COLS){
+		return FRAME_ERR_ARGS;
+	}
+	if(count > LCD_COLS - col){		//clip at the end of the row
+		count = LCD_COLS - col;
+	}
+	memcpy(&lcdFrame[lcdPanel][row][col], chars, count);
+	return 0;
+}
+
+/*
+ * Function:	frame_send
+ *  Queues a frame for USART0 - used for the ACK and NAK replies.
+ *
+ *  seq		uint8_t		sequence number being answered
+ *  op		uint8_t		FRAME_OP_ACK or FRAME_OP_NAK
+ *  payload	uint8_t*	payload bytes (may be NULL if len is 0)
+ *  len		uint8_t		payload length
  *
  *  returns:	none
  */
-void outputHardChars(char char1, char char2){
-	//  Write a single character  //
-	// line one	 //
-	LCD_write_char(char1);
+void frame_send(uint8_t seq, uint8_t op, uint8_t* payload, uint8_t len){
+	uint16_t crc = 0xFFFF;
 	
-	// line two  //
-	LCD_write_instruction(LCD_4bit_cursorSET | LineTwoStart);	//change line
-	_delay_us(80);   //  delay must be > 37us  - datasheet forgets to mention this //
-	LCD_write_char(char2);
+	crc = crc16_update(crc, len);
+	crc = crc16_update(crc, seq);
+	crc = crc16_update(crc, op);
+	uart_write(0, FRAME_SOF);
+	uart_write(0, len);
+	uart_write(0, seq);
+	uart_write(0, op);
+	for(uint8_t i = 0; i < len; i++){
+		uart_write(0, payload[i]);
+		crc = crc16_update(crc, payload[i]);
+	}
+	uart_write(0, crc >> 8);
+	uart_write(0, crc & 0xFF);
+	return;
+}
+
+#if SNAPSHOT
+_Static_assert(SNAP_SLOTS >= 2 && SNAP_SLOTS <= 32, "snapshot ring needs 2 to 32 slots");
+
+/*
+ * Function:	snapshot_schedule
+ *  Called when input may have changed the display state. The first call 
+ *  starts SOFT_TIMER_SNAPSHOT, later ones leave it running, so everything
+ *  that changes within SNAPSHOT_DELAY_MS goes into one record and a steady
+ *  stream of updates is still saved every SNAPSHOT_DELAY_MS.
+ *
+ *  returns:	none
+ */
+void snapshot_schedule(void){
+	if(!snapArmed){
+		snapArmed = 1;
+		soft_timer_start(SOFT_TIMER_SNAPSHOT, SNAPSHOT_DELAY_MS, 0);
+	}
+	return;
+}
+
+/*
+ * Function:	snapshot_save
+ *  TASK_SNAPSHOT - copies the display state into snapRecord and hands it
+ *  to the system tick, which writes it to the slot after the newest one.
+ *  Nothing is written if the state is the same as in the newest record. 
+ *  If the last record is still being written, the timer is started again.
+ *
+ *  LCDLine	int[]	LCD line the next string goes to, for each panel
+ *
+ *  returns:	none
+ */
+void snapshot_save(int LCDLine[LCD_PANELS]){
+	uint8_t* bytes = (uint8_t*)&snapRecord;
+	uint16_t crc = 0xFFFF;
+	
+	if(snapWriting){
+		soft_timer_start(SOFT_TIMER_SNAPSHOT, SNAPSHOT_DELAY_MS, 0);
+		return;
+	}
+	snapArmed = 0;
+	
+	snapRecord.layout = SNAP_LAYOUT;
+	memcpy(snapRecord.frame, lcdFrame, sizeof(snapRecord.frame));
+	for(uint8_t panel = 0; panel < LCD_PANELS; panel++){
+		snapRecord.line[panel] = LCDLine[panel];
+	}
+	memcpy(snapRecord.textCol, textCol, sizeof(snapRecord.textCol));
+	memcpy(snapRecord.textAtCursor, textAtCursor, sizeof(snapRecord.textAtCursor));
+	memcpy(snapRecord.displayCtrl, lcdDisplayCtrl, sizeof(snapRecord.displayCtrl));
+	memcpy(snapRecord.glyphSlotId, glyphSlotId, sizeof(snapRecord.glyphSlotId));
+	memcpy(snapRecord.glyphUser, glyphBitmap[GLYPH_USER_FIRST], sizeof(snapRecord.glyphUser));
+	memcpy(snapRecord.uartPanel, uartPanel, sizeof(snapRecord.uartPanel));
+	snapRecord.lcdPanel = lcdPanel;
+	snapRecord.backlightLevel = backlightLevel;
+	snapRecord.backlightOn = backlightOn;
+	
+	for(uint16_t i = 0; i < offsetof(struct snap_record, seq); i++){
+		crc = crc16_update(crc, bytes[i]);
+	}
+	if(snapSlot != SNAP_NONE && crc == snapStateCrc){
+		return;				//nothing changed since the newest record
+	}
+	snapStateCrc = crc;
+	snapSeq++;
+	snapSlot = (snapSlot == SNAP_NONE || snapSlot + 1 == SNAP_SLOTS) ? 0 : snapSlot + 1;
+	snapRecord.seq[0] = snapSeq >> 8;
+	snapRecord.seq[1] = snapSeq & 0xFF;
+	crc = crc16_update(crc, snapRecord.seq[0]);
+	crc = crc16_update(crc, snapRecord.seq[1]);
+	snapRecord.crc[0] = crc >> 8;
+	snapRecord.crc[1] = crc & 0xFF;
+	
+	cli();				//record is complete before the tick sees it
+	snapWriteAt = 0;
+	snapWriting = 1;
+	sei();
+	return;
+}
+
+/*
+ * Function:	snapshot_write_step
+ *  Called by the system tick while a record is being written and the 
+ *  EEPROM is free. Checks up to SNAP_COMPARES bytes of the slot against 
+ *  snapRecord and starts writing the first one that differs, so bytes that
+ *  already match cost no write and no wear. A byte write takes 3.4 ms and 
+ *  runs on its own, so the tick never waits for the EEPROM. The CRC is 
+ *  the last thing written - a record cut short by a reset fails its check
+ *  and the one before it is used.
+ *
+ *  returns:	none
+ */
+void snapshot_write_step(void){
+	uint16_t base = snapSlot * sizeof(struct snap_record);
+	const uint8_t* bytes = (const uint8_t*)&snapRecord;
+	uint16_t at = snapWriteAt;
+	
+	for(uint8_t n = 0; n < SNAP_COMPARES; n++, at++){
+		if(at == sizeof(struct snap_record)){
+			snapWriting = 0;
+			statSnapshots++;
+			break;
+		}
+		if(hal_eeprom_read(base + at) != bytes[at]){
+			hal_eeprom_write(base + at, bytes[at]);
+			at++;
+			break;
+		}
+	}
+	snapWriteAt = at;
+	return;
+}
+
+/*
+ * Function:	snapshot_in_range
+ *  Checks the fields of snapRecord that are used as array indexes or sent
+ *  to the LCDs. A good CRC alone does not prove them: a damaged record can
+ *  still match its CRC-16.
+ *
+ *  returns:	1	every panel, line, column and glyph id is in range
+ *		0	the record must not be used
+ */
+uint8_t snapshot_in_range(void){
+	uint8_t i, slot;
+	
+	for(i = 0; i < LCD_PANELS; i++){
+		if(snapRecord.line[i] >= LCD_ROWS || snapRecord.textCol[i] > LCD_COLS
+		   || (snapRecord.displayCtrl[i] & ~(LCD_DISPLAY_ON | LCD_CURSOR_ON | LCD_BLINK_ON))
+		      != LCD_4bit_displayOFF){
+			return 0;
+		}
+		for(slot = 0; slot < GLYPH_SLOTS; slot++){
+			if(snapRecord.glyphSlotId[i][slot] >= GLYPH_IDS
+			   && snapRecord.glyphSlotId[i][slot] != GLYPH_NONE){
+				return 0;
+			}
+		}
+	}
+	for(i = 0; i < UART_PORTS; i++){
+		if(snapRecord.uartPanel[i] >= LCD_PANELS){
+			return 0;
+		}
+	}
+	return snapRecord.lcdPanel < LCD_PANELS;
+}
+
+/*
+ * Function:	snapshot_restore
+ *  Finds the newest snapshot record in the EEPROM that has this build's 
+ *  layout, a good CRC and its fields in range, and puts its state back:
+ *  the frame buffers, text cursors, display control, glyphs, panels and
+ *  backlight. A record that fails either check is skipped for the one
+ *  before it, and with none left the LCDs start blank. The glyphs
+ *  the frames use are loaded into their old CGRAM slots and put ahead of
+ *  the empty slots in the LRU list, so a new glyph takes an empty slot
+ *  before one that is on screen. Called once at start up after LCD_init,
+ *  with interrupts on - LCD_flush then draws the restored frames as soon
+ *  as the LCDs are ready.
+ *
+ *  LCDLine	int[]	LCD line the next string goes to, for each panel
+ *
+ *  returns:	1	a record was restored
+ *		0	no usable record, the LCDs stay blank
+ */
+uint8_t snapshot_restore(int LCDLine[LCD_PANELS]){
+	uint8_t* bytes = (uint8_t*)&snapRecord;
+	uint32_t tried = 0;			//slots that failed their CRC or range check
+	uint16_t seq = 0, crc, i;
+	uint8_t slot, best, id, n;
+	
+	while(hal_eeprom_busy()) hal_wait();	//a write cut off by the reset
+	while(1){
+		best = SNAP_NONE;		//newest slot not tried yet, by its header
+		for(slot = 0; slot < SNAP_SLOTS; slot++){
+			uint16_t base = slot * sizeof(struct snap_record);
+			uint16_t slotSeq;
+			
+			if((tried & (1UL << slot)) || hal_eeprom_read(base) != SNAP_LAYOUT){
+				continue;
+			}
+			slotSeq = hal_eeprom_read(base + offsetof(struct snap_record, seq)) << 8;
+			slotSeq |= hal_eeprom_read(base + offsetof(struct snap_record, seq) + 1);
+			if(best == SNAP_NONE || (int16_t)(slotSeq - seq) > 0){	//numbers wrap
+				best = slot;
+				seq = slotSeq;
+			}
+		}
+		if(best == SNAP_NONE){
+			return 0;
+		}
+		
+		crc = 0xFFFF;
+		for(i = 0; i < sizeof(struct snap_record); i++){
+			bytes[i] = hal_eeprom_read(best * sizeof(struct snap_record) + i);
+			if(i < offsetof(struct snap_record, crc)){
+				crc = crc16_update(crc, bytes[i]);
+			}
+			if(i + 1 == offsetof(struct snap_record, seq)){
+				snapStateCrc = crc;
+			}
+		}
+		if(crc == ((uint16_t)snapRecord.crc[0] << 8 | snapRecord.crc[1])
+		   && snapshot_in_range()){
+			break;
+		}
+		tried |= 1UL << best;
+	}
+	snapSlot = best;
+	snapSeq = seq;
+	
+	memcpy(lcdFrame, snapRecord.frame, sizeof(lcdFrame));
+	memcpy(glyphBitmap[GLYPH_USER_FIRST], snapRecord.glyphUser, sizeof(snapRecord.glyphUser));
+	for(uint8_t panel = 0; panel < LCD_PANELS; panel++){
+		LCDLine[panel] = snapRecord.line[panel];
+		textCol[panel] = snapRecord.textCol[panel];
+		textAtCursor[panel] = snapRecord.textAtCursor[panel];
+		lcdShowAddr[panel] = LCD_ROW_START(LCDLine[panel]) + VT_SHOW_COL(textCol[panel]);
+		if(snapRecord.displayCtrl[panel] != lcdDisplayCtrl[panel]){
+			lcdDisplayCtrl[panel] = snapRecord.displayCtrl[panel];
+			LCD_write_instruction(panel, lcdDisplayCtrl[panel]);
+		}
+		n = 0;				//loaded slots go to the recently used end
+		for(slot = 0; slot < GLYPH_SLOTS; slot++){
+			id = snapRecord.glyphSlotId[panel][slot];
+			if(id != GLYPH_NONE){
+				glyphSlotId[panel][slot] = id;
+				glyphSlot[panel][id] = slot;
+				glyph_upload(panel, slot, id);
+				glyphLru[panel][n++] = slot;
+			}
+		}
+		for(slot = 0; slot < GLYPH_SLOTS; slot++){	//empty ones are taken first
+			if(glyphSlotId[panel][slot] == GLYPH_NONE){
+				glyphLru[panel][n++] = slot;
+			}
+		}
+	}
+	memcpy(uartPanel, snapRecord.uartPanel, sizeof(uartPanel));
+	lcdPanel = snapRecord.lcdPanel;
+	backlightLevel = snapRecord.backlightLevel;
+	backlightOn = snapRecord.backlightOn;
+	hal_backlight_set(backlightOn ? backlightLevel : 0);
+	return 1;
+}
+#endif
+
+#ifdef BENCHMARK
+/*
+ * Function:	runBenchmarks
+ *  Runs each LCD and input check operation BENCH_REPEAT times between 
+ *  BENCH_MARK calls so the simulator can count the cycles each one takes.
+ *  Waits for LCD_init to finish first and leaves the screen blank.
+ *
+ *  returns:	none
+ */
+void runBenchmarks(void){
+	char text[MAX_INPUT] = "benchmark string";
+	char wrapText[MAX_INPUT] = "benchmark string over two lines";
+	volatile int status;		//keeps checkInputLen from being removed
+	int line = 0;
+	
+	while(!LCD_queue_idle()) hal_wait();	//LCD_init still running
+	
+	for(uint8_t i = 0; i < BENCH_REPEAT; i++){
+		line = 0;
+		BENCH_MARK(BENCH_OP_CLEAR_LINE);
+		LCD_clear_line(&line);
+		BENCH_MARK(BENCH_OP_NONE);
+		
+		BENCH_MARK(BENCH_OP_WRITE_STR);
+		LCD_write_str(text, &line);
+		BENCH_MARK(BENCH_OP_NONE);
+		
+		BENCH_MARK(BENCH_OP_WRITE_WRAP);
+		LCD_write_str(wrapText, &line);
+		BENCH_MARK(BENCH_OP_NONE);
+		
+		BENCH_MARK(BENCH_OP_CHECK_LEN);
+		status = checkInputLen(wrapText);
+		BENCH_MARK(BENCH_OP_NONE);
+		
+		//change every visible cell so the flush sends both whole lines
+		text[0] = 'a' + (i & 0x0F);
+		wrapText[0] = text[0];
+		for(uint8_t panel = 0; panel < LCD_PANELS; panel++){
+			for(uint8_t row = 0; row < LCD_ROWS; row++){
+				memset(lcdFrame[panel][row], text[0], LCD_COLS);
+			}
+		}
+		
+		BENCH_MARK(BENCH_OP_FLUSH);
+		LCD_flush();
+		BENCH_MARK(BENCH_OP_NONE);
+		
+		BENCH_MARK(BENCH_OP_LCD_DRAIN);
+		while(!LCD_queue_idle()) hal_wait();
+		BENCH_MARK(BENCH_OP_NONE);
+		
+		//bus cost of one write, as the queue interrupt sends it - entry
+		//mode set again to what it is, so the display does not change
+		cli();
+		BENCH_MARK(BENCH_OP_LCD_BYTE);
+		hal_lcd_rs(0);
+		LCD_write_bus(0, LCD_4bit_entryMODE, 0);
+		BENCH_MARK(BENCH_OP_NONE);
+		sei();
+		hal_delay_us(50);			//instruction executes
+	}
+	(void)status;
+	
+	memset(lcdFrame, ' ', sizeof(lcdFrame));	//leave the screen blank
+	LCD_flush();
+	while(!LCD_queue_idle()) hal_wait();
 	return;
 }
+#endif